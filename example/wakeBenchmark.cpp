@@ -0,0 +1,59 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "simpleAtomicWorkerPool.hpp"
+
+struct Job {
+    int value;
+};
+
+std::atomic<long> total(0);
+
+void worker(Job &job){
+    total.fetch_add(job.value, std::memory_order_relaxed);
+}
+
+template<typename P>
+double measure(bool perThreadWake, int jobNumber, int reps){
+    AtomicArray<Job, P> atomicArray(jobNumber);
+    ThreadOptions options;
+    options.perThreadWake = perThreadWake;
+    std::thread *threads = createThreads<Job>(atomicArray, worker, std::thread::hardware_concurrency(), options);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i=0;i<reps;++i){
+        for(int j=0;j<jobNumber;++j){
+            Job job = {j};
+            atomicArray.append(job);
+        }
+        dispatchJobs(atomicArray);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    endThreads(atomicArray, threads);
+    return std::chrono::duration<double, std::micro>(end - start).count() / reps;
+}
+
+template<typename P>
+void run(const char *name, bool perThreadWake, int reps){
+    const int jobNumbers[] = {1, 4, 64, 4096};
+    std::printf("%-24s", name);
+    for(int jobNumber : jobNumbers){
+        std::printf(" %10.2f", measure<P>(perThreadWake, jobNumber, reps));
+    }
+    std::printf("\n");
+}
+
+int main (int argc, char *argv[])
+{
+    const int reps = argc>1 ? std::atoi(argv[1]) : 20000;
+    std::printf("%-24s %10s %10s %10s %10s\n", "us per batch of", "1 job", "4 jobs", "64 jobs", "4096 jobs");
+    run<FutexWait>("futex, shared word", false, reps);
+    run<FutexWait>("futex, per thread words", true, reps);
+    run<SpinThenFutexWait<> >("spin then futex", false, reps);
+#ifdef __cpp_lib_atomic_wait
+    run<AtomicWait>("std::atomic::wait", false, reps);
+#endif
+    run<SpinWait>("spin", false, reps);
+    return 0;
+}
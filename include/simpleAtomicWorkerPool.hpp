@@ -3,144 +3,2595 @@
  * @brief Simple implementation of a worker pool backed by an array of jobs, using atomics and futexes as syncronization primitives
  */
 /// @example example.cpp
-#include "lockless_sleep_and_wake.hpp"
 #include <algorithm>
+#include <alloca.h>
 #include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <ctime>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <linux/futex.h>
+#include <new>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <string>
+#include <sys/syscall.h>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_DEBUG
+#include <cstdio>
+/// @brief Aborts with a message if an invariant of the pool doesn't hold. Only compiled in when SIMPLE_ATOMIC_WORKER_POOL_DEBUG is defined, as simpleAtomicWorkerPool_debug_dep does, and independent of NDEBUG.
+#define SIMPLE_ATOMIC_WORKER_POOL_ASSERT(condition) do{ if(!(condition)){ std::fprintf(stderr, "%s:%d: simpleAtomicWorkerPool invariant failed: %s\n", __FILE__, __LINE__, #condition); std::abort(); } }while(0)
+#else
+#define SIMPLE_ATOMIC_WORKER_POOL_ASSERT(condition) ((void) 0)
+#endif
+#if defined(__has_include) && __cplusplus >= 202002L
+#if __has_include(<coroutine>)
+#include <coroutine>
+/// @brief Defined when the compiler supports C++20 coroutines, enables schedule() and dispatchJobsAsync()
+#define SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+#endif
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IO_URING_OP_SUPPORTED
+/// @brief Defined when the kernel headers provide io_uring with IORING_OP_READ and probing, that is Linux 5.6 or later, enables the I/O jobs, see IoRing
+#define SIMPLE_ATOMIC_WORKER_POOL_IO_URING
+#endif
+#endif
+#endif
+/*! @brief Puts the calling thread to sleep as long as the futex word holds the expected value
+ * @param[in]   word            The futex word to sleep on
+ * @param[in]   expected        The value the word must still hold for the thread to go to sleep
+ */
+inline void futexWait(std::atomic_uint32_t &word, std::uint32_t expected){
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+/*! @brief Puts the calling thread to sleep as long as the futex word holds the expected value, or until the deadline
+ * @param[in]   word            The futex word to sleep on
+ * @param[in]   expected        The value the word must still hold for the thread to go to sleep
+ * @param[in]   deadline        The time after which the thread doesn't sleep anymore
+ * @return                      False if the deadline has passed
+ */
+inline bool futexWaitUntil(std::atomic_uint32_t &word, std::uint32_t expected, std::chrono::steady_clock::time_point deadline){
+    std::chrono::nanoseconds remaining = deadline - std::chrono::steady_clock::now();
+    if(remaining.count()<=0) return false;
+    timespec timeout;
+    timeout.tv_sec = (time_t) (remaining.count() / 1000000000);
+    timeout.tv_nsec = (long) (remaining.count() % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+    return true;
+}
+/*! @brief Wakes up threads sleeping on the futex word
+ * @param[in]   word            The futex word the threads sleep on
+ * @param[in]   count           The maximum number of threads to wake up
+ */
+inline void futexWake(std::atomic_uint32_t &word, int count=INT_MAX){
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+/*! @brief Makes an eventfd readable, waking up whoever polls it
+ * @param[in]   fd              The eventfd to signal
+ */
+inline void signalEventfd(int fd){
+    std::uint64_t one = 1;
+    while(write(fd, &one, sizeof(one))<0 && errno==EINTR);
+}
+
+/// @brief Hints the CPU that the calling thread is spinning, to save power and yield the core to its sibling hyperthread
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*! @brief Wait policy sleeping in the kernel on a futex, the default. Idle threads cost nothing, but each wake up is a syscall and a context switch.
+ *
+ * A wait policy is a class with the static functions wait(word, expected), waitUntil(word, expected, deadline) and wake(word, count),
+ * with the same contract as futexWait(), futexWaitUntil() and futexWake(). wait() may return spuriously, the callers check the word again.
+ */
+struct FutexWait{
+    static void wait(std::atomic_uint32_t &word, std::uint32_t expected){
+        futexWait(word, expected);
+    }
+    static bool waitUntil(std::atomic_uint32_t &word, std::uint32_t expected, std::chrono::steady_clock::time_point deadline){
+        return futexWaitUntil(word, expected, deadline);
+    }
+    static void wake(std::atomic_uint32_t &word, int count){
+        futexWake(word, count);
+    }
+};
+/*! @brief Wait policy that never leaves user space: the threads spin on the word, so a wake up takes as long as a cache line transfer,
+ * but each idle thread keeps a core busy. Only makes sense with a core per thread, dispatcher included.
+ */
+struct SpinWait{
+    static void wait(std::atomic_uint32_t &word, std::uint32_t expected){
+        while(word.load(std::memory_order_relaxed)==expected) cpuRelax();
+    }
+    static bool waitUntil(std::atomic_uint32_t &word, std::uint32_t expected, std::chrono::steady_clock::time_point deadline){
+        while(word.load(std::memory_order_relaxed)==expected){
+            if(std::chrono::steady_clock::now()>=deadline) return false;
+            cpuRelax();
+        }
+        return true;
+    }
+    static void wake(std::atomic_uint32_t &, int){}
+};
+/*! @brief Wait policy spinning for a while before sleeping on a futex, so that batches dispatched back to back don't pay for a context switch,
+ * while idle pools still go to sleep
+ * @tparam Spins The number of times the word is polled before going to sleep
+ */
+template<int Spins=4096>
+struct SpinThenFutexWait{
+    static void wait(std::atomic_uint32_t &word, std::uint32_t expected){
+        for(int i=0;i<Spins;++i){
+            if(word.load(std::memory_order_relaxed)!=expected) return;
+            cpuRelax();
+        }
+        futexWait(word, expected);
+    }
+    static bool waitUntil(std::atomic_uint32_t &word, std::uint32_t expected, std::chrono::steady_clock::time_point deadline){
+        for(int i=0;i<Spins;++i){
+            if(word.load(std::memory_order_relaxed)!=expected) return true;
+            cpuRelax();
+        }
+        return futexWaitUntil(word, expected, deadline);
+    }
+    static void wake(std::atomic_uint32_t &word, int count){
+        futexWake(word, count);
+    }
+};
+#ifdef __cpp_lib_atomic_wait
+/*! @brief Wait policy using the C++20 std::atomic wait and notify functions, portable beyond Linux. Since they can't time out,
+ * waitUntil() polls the word, yielding the core in between.
+ */
+struct AtomicWait{
+    static void wait(std::atomic_uint32_t &word, std::uint32_t expected){
+        word.wait(expected);
+    }
+    static bool waitUntil(std::atomic_uint32_t &word, std::uint32_t expected, std::chrono::steady_clock::time_point deadline){
+        while(word.load()==expected){
+            if(std::chrono::steady_clock::now()>=deadline) return false;
+            std::this_thread::yield();
+        }
+        return true;
+    }
+    static void wake(std::atomic_uint32_t &word, int count){
+        if(count==1) word.notify_one();
+        else word.notify_all();
+    }
+};
+#endif
+
+/*! @brief Puts the dispatcher to sleep until the batch is done. The word holds 0 while the batch runs, 1 once it's done, and 2 while the dispatcher
+ * sleeps on it, so that the worker finishing the batch only makes the wake up syscall when someone is actually waiting.
+ * @tparam      P               The wait policy to sleep with
+ * @param[in]   word            The futex word the dispatcher sleeps on
+ */
+template<typename P>
+void sleepDispatcher(std::atomic_uint32_t &word){
+    std::uint32_t state = word.load();
+    while(state!=1){
+        if(state==0 && !word.compare_exchange_strong(state, 2)) continue;
+        P::wait(word, 2);
+        state = word.load();
+    }
+}
+/*! @brief Puts the dispatcher to sleep until the batch is done or the deadline has passed, see sleepDispatcher()
+ * @tparam      P               The wait policy to sleep with
+ * @param[in]   word            The futex word the dispatcher sleeps on
+ * @param[in]   deadline        The time after which the dispatcher doesn't sleep anymore
+ * @return                      True if the batch is done
+ */
+template<typename P>
+bool sleepDispatcherUntil(std::atomic_uint32_t &word, std::chrono::steady_clock::time_point deadline){
+    std::uint32_t state = word.load();
+    while(state!=1){
+        if(state==0 && !word.compare_exchange_strong(state, 2)) continue;
+        if(!P::waitUntil(word, 2, deadline)) return word.load()==1;
+        state = word.load();
+    }
+    return true;
+}
+/*! @brief Marks the batch as done, waking up the dispatcher only if it's asleep, see sleepDispatcher()
+ * @tparam      P               The wait policy the dispatcher sleeps with
+ * @param[in]   word            The futex word the dispatcher sleeps on
+ */
+template<typename P>
+void wakeDispatcher(std::atomic_uint32_t &word){
+    if(word.exchange(1)==2) P::wake(word, 1);
+}
+
+/*! @brief Non owning view over contiguous jobs
+ * @tparam J The type of the jobs
+ */
+template<typename J>
+struct JobSpan{
+    J *jobs;                                    ///< The first job of the span
+    std::size_t count;                          ///< The number of jobs in the span
+    /// @brief Returns a pointer to the first job
+    J* begin() const{
+        return jobs;
+    }
+    /// @brief Returns a pointer past the last job
+    J* end() const{
+        return jobs + count;
+    }
+    /// @brief Returns the number of jobs
+    std::size_t size() const{
+        return count;
+    }
+    /// @brief Returns the job at the given index
+    J& operator[](std::size_t index) const{
+        return jobs[index];
+    }
+};
+
+/// @brief Options for the worker threads spawned by createThreads
+struct ThreadOptions{
+    ThreadOptions() : lazy(false), prefaultStack(0), stackSize(0), schedulingPolicy(-1), priority(0), niceValue(0), perThreadWake(false){}
+    bool lazy;                                  ///< Spawn the threads on the first dispatchJobs that needs them instead of in createThreads, good for short lived programs
+    std::size_t prefaultStack;                  ///< Bytes of stack each thread touches when it starts, so that its first batch doesn't page fault on it. 0 to skip it.
+    std::size_t stackSize;                      ///< The stack size of the threads, 0 for the system default. The threads are then created with pthread_create, so the std::thread entries returned by createThreads stay empty: use threadHandle() to reach them.
+    std::string name;                           ///< If not empty, the threads are named after it followed by their index, like "pool-3", truncated to the 15 characters Linux allows
+    int schedulingPolicy;                       ///< The scheduling policy of the threads, like SCHED_FIFO for latency critical pools or SCHED_BATCH for throughput ones, -1 to inherit it. Threads that can't apply it are counted in schedulingFailures.
+    int priority;                               ///< The static priority used with SCHED_FIFO and SCHED_RR, must be 0 for the other policies
+    int niceValue;                              ///< The nice value of the threads, only meaningful for SCHED_OTHER and SCHED_BATCH, 0 to leave it alone
+    bool perThreadWake;                         ///< Each thread sleeps on its own futex word instead of all of them sharing worker_start, so that they can be woken up one by one, see wakeWorker()
+};
+
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+/// @brief A coroutine suspended in schedule(), waiting for a worker to resume it. It lives in the frame of the coroutine itself, so enqueuing it allocates nothing.
+struct ScheduledCoroutine{
+    std::coroutine_handle<> handle;             ///< The suspended coroutine
+    ScheduledCoroutine *next;                   ///< The coroutine scheduled before this one
+};
+#endif
+
+/// @brief The futex word a single worker sleeps on when ThreadOptions::perThreadWake is set, alone on its cache line
+struct alignas(64) WakeSlot{
+    WakeSlot() : word(0), sleeping(0){}
+    std::atomic_uint32_t word;                  ///< Bumped to wake the worker up
+    std::atomic_uint32_t sleeping;              ///< Set by the worker before going to sleep, cleared by whoever wakes it up
+};
+
+struct WorkerContext;
+
 /*! @brief Templated array holding the jobs and syncronization primitives, works as a FIFO queue for all intents and purposes
  *
  * The intended workflow for this class is to be used by a single dispatcher thread, which enqueues all the jobs, which then
  * starts the working threads and goes to sleep until they're finished. After the queue is done and the working threads
  * have gone to sleep, the dispatcher thread can enqueue new jobs into the array.
- * @tparam J The type of the jobs that the user wants to execute
+ * @tparam J The type of the jobs that the user wants to execute, trivially copyable since the jobs are moved around with memcpy and never destroyed
+ * @tparam P The wait policy the threads sleep and wake up with, see FutexWait
  */
-template<typename J>
+template<typename J, typename P=FutexWait>
 class AtomicArray{
+    static_assert(std::is_trivially_copyable<J>::value, "AtomicArray relocates the jobs with memcpy and never destroys them, so they must be trivially copyable");
     public:
         /*! @brief Constructor for AtomicArray
          *  @param[in] size The starting size of the array
+         *  @note      The memory is only allocated, the jobs aren't constructed until they're appended
          */
-        AtomicArray(int size){
+        AtomicArray(std::size_t size){
             this->size = size;
-            backingArray = new J[size];
+            initialSize = size;
+            growthFactor = 2;
+            shrinkAfter = 0;
+            smallBatches = 0;
+            recentPeak = 0;
+            hugePages = false;
+            backingArray = allocateJobs(size);
+            activeArray = backingArray;
             tailCursor = 0;
             headCursor.store(0);
+            finishedJobs.store(0);
+            droppedCount.store(0);
+            cancelled.store(false);
+            exceptionCount.store(0);
+            cancelOnException = false;
             worker_start = 0;
             worker_end = 0;
             dispatcher_wake = 0;
+            worker_park = 0;
+            sleeping_workers = 0;
+            batch_id = 0;
+            busy_workers = 0;
+            activeThreads.store(INT_MAX);
+            threadCount = 0;
+            busyNanoseconds.store(0);
+            batchNanoseconds = 0;
+            batchJobs = 0;
+            threads = nullptr;
+            native_threads = nullptr;
+            schedulingFailures.store(0);
+            dispatcher_context = nullptr;
+            wake_slots = nullptr;
+            spawnedThreads = 0;
+            completion_fd = -1;
+            signal_completion = false;
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+            scheduled.store(nullptr);
+#endif
         }
-        ///@brief Destructor for AtomicArray, frees the dynamically allocated backing array
+        ///@brief Destructor for AtomicArray, frees the dynamically allocated backing array and the context of the dispatcher, and closes the completion eventfd, if any
         ~AtomicArray(){
-            delete[] backingArray;
+            std::free(backingArray);
+            delete dispatcher_context;
+            if(completion_fd>=0) close(completion_fd);
         }
         /*! @brief Used to add jobs to the array
          *  @param[in]  element The job to add to the array at the bottom of the queue
          *  @return             A pointer to the job in the array
-         *  @note               If the backing array is full, it will be reallocated and doubled in size
+         *  @note               If the backing array is full, it will be reallocated and grown by the growth factor, see setGrowthFactor().
+         *                      Throws std::logic_error while a buffer is borrowed, see borrow().
          * */
         J* append(J element){
-            int index = tailCursor;
+            checkNotBorrowed();
+            std::size_t index = tailCursor;
             ++tailCursor;
             if(index==size){
-                J* oldArray = backingArray;
-                backingArray = new J[size*2];
-                std::memcpy(backingArray, oldArray, size * sizeof(J));
-                size = size*2;
-                delete[] oldArray;
+                resize(grownSize(size + 1));
             }
             std::memcpy(backingArray + index, &element, sizeof(J));
             return backingArray + index;
         }
+        /*! @brief Used to add a sequence of jobs to the array, growing it at most once and copy constructing the jobs in place
+         *  @tparam     Iterator    A forward iterator over the jobs
+         *  @param[in]  first       The first job to add
+         *  @param[in]  last        The end of the sequence of jobs to add
+         *  @return                 A span over the jobs in the array
+         *  @note                   Throws std::logic_error while a buffer is borrowed, see borrow()
+         */
+        template<typename Iterator>
+        JobSpan<J> appendRange(Iterator first, Iterator last){
+            std::size_t count = std::distance(first, last);
+            J* jobs = extend(count);
+            for(J* job = jobs;first!=last;++first, ++job){
+                new (job) J(*first);
+            }
+            return JobSpan<J>{jobs, count};
+        }
+        /*! @brief Used to add a number of generated jobs to the array, growing it at most once and constructing the jobs in place
+         *  @tparam     Generator   A callable taking the index of the job in the new sequence, starting from 0, and returning the job
+         *  @param[in]  count       The number of jobs to add
+         *  @param[in]  generator   The callable generating the jobs
+         *  @return                 A span over the jobs in the array
+         *  @note                   Throws std::logic_error while a buffer is borrowed, see borrow()
+         */
+        template<typename Generator>
+        JobSpan<J> appendN(std::size_t count, Generator generator){
+            J* jobs = extend(count);
+            for(std::size_t i=0;i<count;++i){
+                new (jobs + i) J(generator(i));
+            }
+            return JobSpan<J>{jobs, count};
+        }
+        /*! @brief Drops the last jobs enqueued, for example the unused tail of an appendN() over an upper bound
+         *  @param[in]  count   The number of jobs to keep, nothing happens if it's not less than jobCount()
+         */
+        void truncate(std::size_t count){
+            SIMPLE_ATOMIC_WORKER_POOL_ASSERT(!batchOpen());
+            if(count<tailCursor) tailCursor = count;
+        }
+        /*! @brief Hands over an external buffer of jobs to be dispatched in place of the backing array, without copying them.
+         * The array must be empty, and the buffer must stay valid and untouched until the jobs have been dispatched.
+         *  @param[in]  jobs    The first job of the buffer
+         *  @param[in]  count   The number of jobs in the buffer
+         *  @note               No jobs can be appended while a buffer is borrowed, emptyOut() goes back to the backing array.
+         *                      reserve() and shrink_to_fit() only reallocate the backing array, leaving the borrowed buffer in place.
+         *                      Throws std::logic_error if the array isn't empty.
+         */
+        void borrow(J *jobs, std::size_t count){
+            if(tailCursor) throw std::logic_error("AtomicArray: can't borrow a buffer while jobs are enqueued");
+            activeArray = jobs;
+            tailCursor = count;
+        }
+        /*! @brief Makes sure the array can hold at least the given number of jobs without reallocating
+         *  @param[in]  capacity    The number of jobs the array needs to hold
+         */
+        void reserve(std::size_t capacity){
+            if(capacity>size) resize(capacity);
+        }
+        /// @brief Reallocates the array to the smallest size holding the jobs currently enqueued, or the starting size if larger
+        void shrink_to_fit(){
+            std::size_t target = activeArray==backingArray ? std::max(tailCursor, initialSize) : initialSize;
+            if(target<size) resize(target);
+        }
+        /*! @brief Sets by how much the array grows when appending to a full array
+         *  @param[in]  factor  The factor the size gets multiplied by, 2 by default
+         */
+        void setGrowthFactor(int factor){
+            growthFactor = std::max(factor, 2);
+        }
+        /*! @brief Lets the array give back memory after a spike: once enough consecutive batches have used less than a quarter of
+         * the allocated size, the array gets shrunk to twice the largest of those batches, but never below its starting size
+         *  @param[in]  batches The number of consecutive small batches before shrinking, 0 (the default) never shrinks
+         */
+        void setShrinkPolicy(int batches){
+            shrinkAfter = batches;
+            smallBatches = 0;
+            recentPeak = 0;
+        }
+        /*! @brief Backs the array with transparent huge pages when it's at least as large as a huge page, to reduce TLB misses on very large batches.
+         * Takes effect at the next reallocation, call reserve() to apply it to a known batch size.
+         *  @param[in]  enable  Whether to use huge pages, off by default
+         */
+        void useHugePages(bool enable){
+            hugePages = enable;
+        }
         /*! @brief Fetches the first job in the queue
          *  @return The first job in the queue, or nullptr if the queue is empty
+         *  @note   The head is checked before being incremented, so that polling an empty queue doesn't keep moving it past the tail
          */
         J* fetch(){
-            int index = headCursor.fetch_add(1);
+            if(headCursor.load(std::memory_order_relaxed)>=tailCursor) return nullptr;
+            std::size_t index = headCursor.fetch_add(1);
             if(index>=tailCursor) return nullptr;
-            return backingArray + index;
+            return activeArray + index;
+        }
+        /*! @brief Fetches a range of contiguous jobs from the top of the queue with a single atomic operation
+         *  @param[in]  maxCount    The maximum number of jobs to fetch
+         *  @return                 A span over the fetched jobs, empty if the queue is empty
+         */
+        JobSpan<J> fetchRange(std::size_t maxCount){
+            if(headCursor.load(std::memory_order_relaxed)>=tailCursor) return JobSpan<J>{nullptr, 0};
+            std::size_t index = headCursor.fetch_add(maxCount);
+            if(index>=tailCursor) return JobSpan<J>{nullptr, 0};
+            return JobSpan<J>{activeArray + index, std::min<std::size_t>(maxCount, tailCursor - index)};
+        }
+        /*! @brief Drops the jobs that haven't been fetched yet, so that fetch() returns nullptr from now on. The fetch path is untouched:
+         * the head of the queue is just moved to its tail, and the dropped jobs are counted as finished.
+         * Only affects the batch running when it's called: it does nothing if no batch is running, and the next openBatch() clears it.
+         *  @param[out] finished    Set to true if no job was still being executed, so that the batch is done, see cancelJobs()
+         *  @return                 The number of jobs dropped
+         */
+        std::size_t cancel(bool &finished){
+            finished = false;
+            if(!enterBatch(nullptr)) return 0;
+            cancelled.store(true, std::memory_order_relaxed);
+            std::size_t head = headCursor.exchange(tailCursor);
+            std::size_t dropped = head<tailCursor ? tailCursor - head : 0;
+            droppedCount.fetch_add(dropped);
+            finished = markFinished(dropped);
+            leaveBatch();
+            return dropped;
+        }
+        /// @brief Returns whether the current batch has been cancelled, cheap enough to be polled by long running jobs
+        bool isCancelled() const{
+            return cancelled.load(std::memory_order_relaxed);
+        }
+        /// @brief Called by the dispatcher once the jobs of a batch have been enqueued, before waking up the workers
+        void openBatch(){
+            SIMPLE_ATOMIC_WORKER_POOL_ASSERT(!batchOpen() && headCursor.load()==0 && !finishedJobs.load());
+            cancelled.store(false, std::memory_order_relaxed);
+            firstException = nullptr;
+            exceptionCount.store(0);
+            batch_id.fetch_add(1);
+        }
+        /// @brief Returns whether a batch is running, that is between openBatch() and closeBatch()
+        bool batchOpen() const{
+            return batch_id.load() & 1;
+        }
+        /*! @brief Called by the dispatcher when a batch is done, waits for the workers that are still leaving it. After this no worker
+         * touches the cursors until the next openBatch(), so the array can be reset and refilled.
+         * Does nothing if no batch is running.
+         */
+        void closeBatch(){
+            if(!batchOpen()) return;
+            batch_id.fetch_add(1);
+            while(busy_workers.load()) std::this_thread::yield();
+        }
+        /*! @brief Called by the workers before fetching jobs, makes sure there's a running batch, and that the worker doesn't run it twice
+         *  @param[in,out]  served  The id of the last batch run by the calling worker, updated if the worker enters a new one. Null to allow running a batch again.
+         *  @return                 True if the worker can fetch jobs, in which case it must call leaveBatch() once it's done with them
+         */
+        bool enterBatch(std::uint32_t *served){
+            std::uint32_t id = batch_id.load();
+            if(!(id & 1) || (served && *served==id)) return false;
+            busy_workers.fetch_add(1);
+            if(batch_id.load()!=id){
+                busy_workers.fetch_sub(1);
+                return false;
+            }
+            if(served) *served = id;
+            return true;
+        }
+        /// @brief Called by the workers once they don't touch the cursors anymore, see enterBatch()
+        void leaveBatch(){
+            SIMPLE_ATOMIC_WORKER_POOL_ASSERT(busy_workers.load());
+            busy_workers.fetch_sub(1);
+        }
+        /*! @brief Records an exception thrown by a job, to be rethrown to the dispatcher once the batch is done. Only the first exception of a batch is kept,
+         * the others are just counted, see failedJobs(). If enabled by setCancelOnException(), the rest of the batch is cancelled.
+         *  @param[in]  exception   The exception thrown by the job
+         *  @param[in]  jobs        The number of jobs counted as failed, the whole range for batch workers
+         */
+        void recordException(std::exception_ptr exception, int jobs=1){
+            if(!exceptionCount.fetch_add(jobs)) firstException = exception;
+            if(cancelOnException){
+                bool finished;
+                cancel(finished);
+            }
+        }
+        /*! @brief Rethrows the first exception thrown by a job of the last batch, if any, called by the dispatcher once the batch is done
+         */
+        void rethrowException(){
+            if(!firstException) return;
+            std::exception_ptr exception = firstException;
+            firstException = nullptr;
+            std::rethrow_exception(exception);
+        }
+        /// @brief Returns the number of jobs of the last batch that threw an exception, counting the whole range when a batch worker throws
+        int failedJobs() const{
+            return exceptionCount.load();
+        }
+        /*! @brief Sets whether the first exception thrown by a job cancels the rest of the batch, see cancel()
+         *  @param[in]  enable  Whether to cancel the batch, off by default
+         */
+        void setCancelOnException(bool enable){
+            cancelOnException = enable;
+        }
+        /*! @brief Marks jobs of the current batch as done, called by each worker once it finds the queue empty
+         *  @param[in]  count   The number of jobs the calling worker has executed during this batch
+         *  @return             True if these were the last jobs of the batch, which happens for exactly one worker
+         */
+        bool markFinished(std::size_t count){
+            if(!count) return false;
+            std::size_t finished = finishedJobs.fetch_add(count) + count;
+            SIMPLE_ATOMIC_WORKER_POOL_ASSERT(finished<=tailCursor);
+            return finished==tailCursor;
+        }
+        /*! @brief Touches every page of the backing array so that it's faulted in before the first batch
+         *  @note   Meant for long lived programs, call it after reserve() so that it covers the largest expected batch
+         */
+        void prefault(){
+            std::memset(static_cast<void*>(backingArray), 0, size * sizeof(J));
+        }
+        /// @brief Returns the number of jobs of the current batch already fetched by the workers, counting the ones dropped by cancel()
+        std::size_t fetchedJobs() const{
+            return std::min(headCursor.load(), tailCursor);
+        }
+        /// @brief Returns the number of jobs of the current batch dropped by cancel()
+        std::size_t droppedJobs() const{
+            return droppedCount.load();
+        }
+        /*! @brief Returns the number of jobs of the current batch executed so far, including the ones that threw.
+         *  @note   The workers report their jobs once they find the queue empty, so while the batch runs this is a lower bound
+         */
+        std::size_t completedJobs() const{
+            std::size_t finished = finishedJobs.load();
+            std::size_t dropped = droppedCount.load();
+            return finished>dropped ? finished - dropped : 0;
+        }
+        /// @brief Returns the raw head cursor of the queue, which polling an empty queue can push past the tail by at most one fetch per thread
+        std::size_t headPosition() const{
+            return headCursor.load();
+        }
+        /// @brief Returns the number of jobs currently enqueued in the array
+        std::size_t jobCount() const{
+            return tailCursor;
         }
         /// @brief Resets the internal counters that keep track of how full the array is, effectively treating it as empty
         void emptyOut(){
+            if(shrinkAfter && activeArray==backingArray){
+                if(tailCursor*4<size){
+                    recentPeak = std::max(recentPeak, tailCursor);
+                    if(++smallBatches>=shrinkAfter){
+                        std::size_t target = std::max(recentPeak*2, initialSize);
+                        if(target<size) resize(target);
+                        smallBatches = 0;
+                        recentPeak = 0;
+                    }
+                } else{
+                    smallBatches = 0;
+                    recentPeak = 0;
+                }
+            }
+            activeArray = backingArray;
             tailCursor = 0;
             headCursor.store(0);
+            finishedJobs.store(0);
+            droppedCount.store(0);
+            cancelled.store(false);
         }
-        std::atomic_uint32_t worker_start;      ///< The atomic used as a syncronization primitive to tell the workers to wake up or go to sleep
+        std::atomic_uint32_t worker_start;      ///< The futex word the workers sleep on between batches, bumped whenever a batch is dispatched
         std::atomic_uint32_t worker_end;        ///< The atomic used as a syncronization primitive to tell the workers whether to return and become joinable
-        std::atomic_uint32_t dispatcher_wake;   ///< The atomic used as a syncronization primitive to tell the dispatcher to wake up or go to sleep
+        std::atomic_uint32_t dispatcher_wake;   ///< The futex word the dispatcher sleeps on, see sleepDispatcher()
+        std::atomic_uint32_t worker_park;       ///< The futex word the surplus threads sleep on, bumped whenever the number of active threads changes
+        std::atomic_uint32_t sleeping_workers;  ///< The number of workers asleep on worker_start, so that no wake up syscall is made when there are none
+        WakeSlot *wake_slots;                   ///< The futex words of the workers if ThreadOptions::perThreadWake is set, one per thread, null otherwise
+        std::atomic_uint32_t batch_id;          ///< Incremented when a batch is dispatched and when it ends, so it's odd while a batch is running
+        std::atomic_uint32_t busy_workers;      ///< The number of workers between enterBatch() and leaveBatch()
+        std::atomic_int activeThreads;          ///< The number of threads taking part in the batches, the ones with a higher index stay parked
+        int threadCount;                        ///< The number of threads spawned by createThreads
+        std::atomic<long long> busyNanoseconds; ///< The time the threads spent executing jobs during the last batch, summed over all threads
+        long long batchNanoseconds;             ///< The time the last batch took from the point of view of the dispatcher
+        std::chrono::steady_clock::time_point batchStart; ///< The time the current batch was dispatched at
+        std::size_t batchJobs;                  ///< The number of jobs of the last batch
+        std::thread *threads;                   ///< The threads created by createThreads
+        pthread_t *native_threads;              ///< The handles of all the threads spawned by createThreads, whether they were created with std::thread or pthread_create, see threadHandle()
+        int spawnedThreads;                     ///< The number of threads already running, less than threadCount until all the lazy threads have been needed
+        std::atomic_int schedulingFailures;     ///< The number of spawned threads that couldn't apply ThreadOptions::schedulingPolicy or niceValue, final once the threads are spawned
+        std::function<void(int, int)> threadBody; ///< The function run by each thread, taking the index of the thread and the number of threads
+        ThreadOptions threadOptions;            ///< The options the threads were created with
+        WorkerContext *dispatcher_context;      ///< The context the dispatcher executes jobs with in dispatchJobs(atomicArray, worker), kept across batches, null until first needed
+        int completion_fd;                      ///< The eventfd signalled when a batch started by startJobs() is done, -1 until completionFd() is called
+        bool signal_completion;                 ///< Whether the current batch was started by startJobs(), so that completion_fd must be signalled once it's done
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+        std::coroutine_handle<> continuation;   ///< The coroutine suspended in dispatchJobsAsync, resumed by the worker finishing the last job
+        std::atomic<ScheduledCoroutine*> scheduled; ///< The coroutines suspended in schedule(), pushed by any thread and taken all at once by a worker
+#endif
     private:
+        static const std::size_t hugePageSize = 2*1024*1024;
+        /*! @brief Allocates uninitialized memory for the jobs, aligned to a cache line or to a huge page when enabled
+         *  @param[in]  count   The number of jobs to allocate memory for
+         *  @return             A pointer to the allocated memory
+         */
+        J* allocateJobs(std::size_t count){
+            std::size_t bytes = std::max<std::size_t>(count, 1) * sizeof(J);
+            bool huge = hugePages && bytes>=hugePageSize;
+            std::size_t alignment = huge ? hugePageSize : std::max<std::size_t>(alignof(J), 64);
+            void *memory;
+            if(posix_memalign(&memory, alignment, bytes)) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            if(huge) madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+            return static_cast<J*>(memory);
+        }
+        /*! @brief Computes the size to grow the array to, applying the growth factor unless that would overflow
+         *  @param[in]  needed  The minimum size the array must have
+         *  @return             The new size of the array
+         */
+        std::size_t grownSize(std::size_t needed) const{
+            std::size_t grown = size<=SIZE_MAX/sizeof(J)/growthFactor ? size*growthFactor : needed;
+            return std::max(grown, needed);
+        }
+        /*! @brief Moves the jobs to a newly allocated array of a different size. While a buffer is borrowed the backing array holds no jobs,
+         * so it's just reallocated and the borrowed buffer stays active.
+         *  @param[in]  newSize The size of the new array, must not be smaller than the number of jobs enqueued
+         */
+        void resize(std::size_t newSize){
+            J* oldArray = backingArray;
+            bool borrowed = activeArray!=backingArray;
+            backingArray = allocateJobs(newSize);
+            if(!borrowed){
+                activeArray = backingArray;
+                std::memcpy(backingArray, oldArray, std::min(tailCursor, size) * sizeof(J));
+            }
+            size = newSize;
+            std::free(oldArray);
+        }
+        /// @brief Throws std::logic_error if a buffer is borrowed, since the jobs appended would land past the end of the backing array
+        void checkNotBorrowed() const{
+            if(activeArray!=backingArray) throw std::logic_error("AtomicArray: can't append while a buffer is borrowed");
+        }
+        /*! @brief Reserves room for new jobs at the bottom of the queue, growing the array once if needed
+         *  @param[in]  count   The number of jobs to make room for
+         *  @return             A pointer to the first of the new slots
+         */
+        J* extend(std::size_t count){
+            checkNotBorrowed();
+            std::size_t index = tailCursor;
+            std::size_t needed = tailCursor + count;
+            if(needed>size){
+                resize(grownSize(needed));
+            }
+            tailCursor = needed;
+            return backingArray + index;
+        }
         J *backingArray;                        ///< The memory backing the AtomicArray
-        int tailCursor;                         ///< Internal counter to keep track of how full is the array 
-        std::atomic_int headCursor;             ///< Internal counter to find the first job in the queue
-        int size;                               ///< Current size of the allocated memory
+        J *activeArray;                         ///< The jobs being dispatched, either the backing array or a borrowed buffer
+        std::size_t tailCursor;                 ///< Internal counter to keep track of how full is the array 
+        std::atomic<std::size_t> headCursor;    ///< Internal counter to find the first job in the queue, it overshoots the tail by at most one fetch per thread
+        std::atomic<std::size_t> finishedJobs;  ///< Internal counter of the jobs of the current batch that are done, executed or dropped, added by each worker once it finds the queue empty
+        std::atomic<std::size_t> droppedCount;  ///< The jobs of the current batch dropped by cancel()
+        std::atomic_bool cancelled;             ///< Whether the current batch has been cancelled
+        std::exception_ptr firstException;      ///< The first exception thrown by a job of the current batch
+        std::atomic_int exceptionCount;         ///< The number of jobs of the current batch that threw an exception
+        bool cancelOnException;                 ///< Whether the first exception thrown by a job cancels the rest of the batch
+        std::size_t size;                       ///< Current size of the allocated memory
+        std::size_t initialSize;                ///< The size the array was constructed with, it never shrinks below it
+        int growthFactor;                       ///< The factor the size gets multiplied by when the array is full
+        int shrinkAfter;                        ///< The number of consecutive small batches after which the array shrinks, 0 to never shrink
+        int smallBatches;                       ///< The number of consecutive batches that used less than a quarter of the array
+        std::size_t recentPeak;                 ///< The largest of the consecutive small batches
+        bool hugePages;                         ///< Whether large allocations are backed by transparent huge pages
 };
 
-/*! @brief Wrapper function for the working thread function that takes care of all the syncronization, sleeping and waking up
- * @tparam      J               The type of the jobs the user wants to execute 
+/*! @brief Structure of arrays storage for jobs made of several fields, each stored in its own cache line aligned array.
+ *
+ * Meant for workers that process many jobs at once with vectorized kernels touching only some of the fields: the jobs are
+ * stored here and dispatched in chunks of indices through an AtomicArray<SoAChunk<Ts...>>, see appendChunks().
+ * The fields are copied with memcpy, so they must be trivially copyable.
+ * @tparam Ts The types of the fields of the jobs
+ */
+template<typename... Ts>
+class SoAArray{
+    public:
+        /// @brief Number of fields of the jobs
+        static const std::size_t fieldCount = sizeof...(Ts);
+        /*! @brief Constructor for SoAArray
+         *  @param[in] size The starting size of the arrays
+         */
+        explicit SoAArray(std::size_t size){
+            this->size = std::max<std::size_t>(size, 1);
+            count = 0;
+            const std::size_t sizes[] = {sizeof(Ts)...};
+            for(std::size_t i=0;i<fieldCount;++i){
+                fields[i] = allocateField(sizes[i] * this->size);
+            }
+        }
+        SoAArray(const SoAArray&) = delete;
+        SoAArray& operator=(const SoAArray&) = delete;
+        ///@brief Destructor for SoAArray, frees the arrays of the fields
+        ~SoAArray(){
+            for(std::size_t i=0;i<fieldCount;++i){
+                std::free(fields[i]);
+            }
+        }
+        /*! @brief Used to add a job to the arrays
+         *  @param[in]  values  The fields of the job
+         *  @return             The index of the job
+         *  @note               If the arrays are full, they will be reallocated and doubled in size
+         */
+        std::size_t append(const Ts&... values){
+            std::size_t index = count;
+            resize(count + 1);
+            const std::size_t sizes[] = {sizeof(Ts)...};
+            const void *sources[] = {&values...};
+            for(std::size_t i=0;i<fieldCount;++i){
+                std::memcpy(static_cast<unsigned char*>(fields[i]) + index * sizes[i], sources[i], sizes[i]);
+            }
+            return index;
+        }
+        /*! @brief Changes the number of jobs, leaving the fields of the new ones uninitialized so that they can be written directly through field()
+         *  @param[in]  newCount    The new number of jobs
+         */
+        void resize(std::size_t newCount){
+            if(newCount>size){
+                std::size_t newSize = std::max(size*2, newCount);
+                const std::size_t sizes[] = {sizeof(Ts)...};
+                for(std::size_t i=0;i<fieldCount;++i){
+                    void *field = allocateField(sizes[i] * newSize);
+                    std::memcpy(field, fields[i], sizes[i] * count);
+                    std::free(fields[i]);
+                    fields[i] = field;
+                }
+                size = newSize;
+            }
+            count = newCount;
+        }
+        /*! @brief Returns the array holding one of the fields of all the jobs
+         *  @tparam I   The index of the field
+         *  @return     A pointer to the field of the first job, aligned to a cache line
+         */
+        template<std::size_t I>
+        typename std::tuple_element<I, std::tuple<Ts...> >::type* field() const{
+            return static_cast<typename std::tuple_element<I, std::tuple<Ts...> >::type*>(fields[I]);
+        }
+        /// @brief Returns the number of jobs in the arrays
+        std::size_t jobCount() const{
+            return count;
+        }
+        /// @brief Removes all the jobs, keeping the memory
+        void clear(){
+            count = 0;
+        }
+    private:
+        static void* allocateField(std::size_t bytes){
+            void *memory;
+            if(posix_memalign(&memory, 64, std::max<std::size_t>(bytes, 1))) throw std::bad_alloc();
+            return memory;
+        }
+        void *fields[fieldCount ? fieldCount : 1];  ///< The arrays of the fields
+        std::size_t count;                      ///< The number of jobs in the arrays
+        std::size_t size;                       ///< Current size of the allocated arrays
+};
+
+/*! @brief Job handed to the workers of an SoAArray, a range of indices into its fields
+ * @tparam Ts The types of the fields of the jobs
+ */
+template<typename... Ts>
+struct SoAChunk{
+    SoAArray<Ts...> *array;                     ///< The arrays holding the jobs
+    std::size_t begin;                          ///< The index of the first job of the chunk
+    std::size_t end;                            ///< The index past the last job of the chunk
+};
+
+/*! @brief Splits the jobs of an SoAArray into chunks and enqueues them, to be dispatched as usual with dispatchJobs
+ * @tparam      P               The wait policy of the array
+ * @tparam      Ts              The types of the fields of the jobs
+ * @param[in]   atomicArray     The array to enqueue the chunks into
+ * @param[in]   soaArray        The arrays holding the jobs, must not be modified until the chunks have been dispatched
+ * @param[in]   chunkSize       The number of jobs of each chunk but the last. With a multiple of the vector width, every chunk but the last starts aligned and has no remainder.
+ * @return                      A span over the chunks in the array
+ */
+template<typename P, typename... Ts>
+JobSpan<SoAChunk<Ts...> > appendChunks(AtomicArray<SoAChunk<Ts...>, P> &atomicArray, SoAArray<Ts...> &soaArray, std::size_t chunkSize){
+    std::size_t jobs = soaArray.jobCount();
+    chunkSize = std::max<std::size_t>(chunkSize, 1);
+    SoAArray<Ts...> *array = &soaArray;
+    return atomicArray.appendN((jobs + chunkSize - 1) / chunkSize, [array, jobs, chunkSize](std::size_t i){
+        SoAChunk<Ts...> chunk = {array, i * chunkSize, std::min(jobs, (i + 1) * chunkSize)};
+        return chunk;
+    });
+}
+
+/*! @brief Bump allocator for the temporary memory the jobs need, owned by a single worker thread
+ *
+ * Allocations just advance a cursor inside a block, and nothing is freed individually: the whole arena is rewound by reset(),
+ * which the worker thread does at the end of each batch. If a batch needed more than one block, they get merged into a single one
+ * on reset, so that after the first few batches the arena settles on one block big enough for the workload.
+ */
+class ScratchArena{
+    public:
+        /*! @brief Constructor for ScratchArena, no memory is allocated until the first call to allocate()
+         *  @param[in]  blockSize   The minimum size in bytes of the blocks the arena allocates
+         */
+        explicit ScratchArena(std::size_t blockSize=64*1024){
+            this->blockSize = blockSize;
+            head = nullptr;
+            current = nullptr;
+            offset = 0;
+        }
+        ScratchArena(const ScratchArena&) = delete;
+        ScratchArena& operator=(const ScratchArena&) = delete;
+        ///@brief Destructor for ScratchArena, frees all the blocks
+        ~ScratchArena(){
+            freeBlocks();
+        }
+        /*! @brief Allocates memory from the arena, valid until the next reset()
+         *  @param[in]  bytes       The size of the memory to allocate
+         *  @param[in]  alignment   The alignment of the memory to allocate, must be a power of two
+         *  @return                 A pointer to the allocated memory
+         */
+        void* allocate(std::size_t bytes, std::size_t alignment=alignof(std::max_align_t)){
+            if(current){
+                std::size_t start = align(current, offset, alignment);
+                if(start + bytes <= current->size){
+                    offset = start + bytes;
+                    return data(current) + start;
+                }
+            }
+            Block *block = newBlock(std::max(blockSize, bytes + alignment));
+            if(current) current->next = block;
+            else head = block;
+            current = block;
+            offset = align(current, 0, alignment) + bytes;
+            return data(current) + offset - bytes;
+        }
+        /*! @brief Allocates an uninitialized array from the arena, valid until the next reset()
+         *  @tparam     T           The type of the elements of the array
+         *  @param[in]  count       The number of elements of the array
+         *  @return                 A pointer to the first element of the array
+         */
+        template<typename T>
+        T* allocateArray(std::size_t count){
+            return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        }
+        /// @brief Frees all the allocations at once, merging the blocks into one if more than one was needed
+        void reset(){
+            if(head && head->next){
+                std::size_t total = 0;
+                for(Block *block = head;block;block = block->next) total += block->size;
+                freeBlocks();
+                head = newBlock(total);
+            }
+            current = head;
+            offset = 0;
+        }
+    private:
+        /// @brief Header of the blocks of memory, the usable memory immediately follows it
+        struct Block{
+            Block *next;                        ///< The next block in the list
+            std::size_t size;                   ///< The usable size of the block
+        };
+        static unsigned char* data(Block *block){
+            return reinterpret_cast<unsigned char*>(block + 1);
+        }
+        static std::size_t align(Block *block, std::size_t offset, std::size_t alignment){
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(data(block)) + offset;
+            return offset + ((alignment - address % alignment) % alignment);
+        }
+        static Block* newBlock(std::size_t size){
+            Block *block = static_cast<Block*>(std::malloc(sizeof(Block) + size));
+            if(!block) throw std::bad_alloc();
+            block->next = nullptr;
+            block->size = size;
+            return block;
+        }
+        void freeBlocks(){
+            while(head){
+                Block *next = head->next;
+                std::free(head);
+                head = next;
+            }
+            current = nullptr;
+        }
+        Block *head;                            ///< The first block of the arena
+        Block *current;                         ///< The block allocations are currently served from
+        std::size_t offset;                     ///< The offset of the first free byte in the current block
+        std::size_t blockSize;                  ///< The minimum size of the blocks
+};
+
+/*! @brief Per thread state handed to the workers that accept it as their last parameter
+ *
+ * Each worker thread creates its own context when it starts, so nothing in it is shared with the other threads,
+ * and per thread data structures can be kept in arrays indexed by threadIndex.
+ */
+struct WorkerContext{
+    /*! @brief Constructor for WorkerContext
+     *  @param[in]  threadIndex The index of the thread, from 0 to threadCount-1
+     *  @param[in]  threadCount The number of threads of the pool
+     */
+    WorkerContext(int threadIndex, int threadCount) : threadIndex(threadIndex), threadCount(threadCount), userData(nullptr){}
+    int threadIndex;                            ///< The index of the thread, from 0 to threadCount-1
+    int threadCount;                            ///< The number of threads of the pool
+    void *userData;                             ///< Per thread state owned by the user, never touched by the pool, for example set on the first job the thread executes
+    ScratchArena arena;                         ///< Scratch memory for the jobs, reclaimed at the end of each batch
+};
+
+/*! @brief Records the statistics of a finished batch and resets the atomicArray to be reusable
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
  * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
- * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue  
+ */
+template<typename J, typename P>
+void endBatch(AtomicArray<J, P> &atomicArray){
+    atomicArray.closeBatch();
+    atomicArray.signal_completion = false;
+    atomicArray.batchNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - atomicArray.batchStart).count();
+    atomicArray.batchJobs = atomicArray.jobCount();
+    atomicArray.emptyOut();
+}
+/*! @brief Called once all the jobs of a batch are done, by whoever finished the last of them: resumes the coroutine awaiting the batch,
+ * or wakes up the dispatcher
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void finishBatch(AtomicArray<J, P> &atomicArray){
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+    if(atomicArray.continuation){
+        std::coroutine_handle<> continuation = atomicArray.continuation;
+        atomicArray.continuation = nullptr;
+        endBatch(atomicArray);
+        continuation.resume();
+        return;
+    }
+#endif
+    if(atomicArray.signal_completion) signalEventfd(atomicArray.completion_fd);
+    wakeDispatcher<P>(atomicArray.dispatcher_wake);
+}
+/*! @brief Cancels the batch being executed: the jobs that haven't been fetched yet are dropped, and the dispatcher is woken up as soon as
+ * the jobs already fetched are done. Can be called from the workers, for example on the first hit of a search, or from any other thread while the batch runs.
+ * Does nothing if no batch is running, so a late call can't cancel the next one.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void cancelJobs(AtomicArray<J, P> &atomicArray){
+    bool finished;
+    atomicArray.cancel(finished);
+    if(finished) finishBatch(atomicArray);
+}
+/*! @brief Calls a worker that doesn't take the context of its thread
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @param[in]   worker          The worker to call
+ * @param[in]   job             The job to execute
+ */
+template<typename J>
+void callWorker(void worker(J &job), J &job, WorkerContext&){
+    worker(job);
+}
+/*! @brief Calls a worker that takes the context of its thread
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @param[in]   worker          The worker to call
+ * @param[in]   job             The job to execute
+ * @param[in]   context         The context of the calling thread
  */
 template<typename J>
-void threadFunction(AtomicArray<J> &atomicArray, void worker(J &job)){
+void callWorker(void worker(J &job, WorkerContext &context), J &job, WorkerContext &context){
+    worker(job, context);
+}
+
+/*! @brief Executes jobs one at a time until the queue is empty. Exceptions thrown by the jobs are recorded in the array, see recordException().
+ * The try block is entered once per batch rather than once per job, and with table based unwinding it costs nothing until a job actually throws.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @tparam      F               The type of the callable executing a single job
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   run             The callable executing a single job
+ * @return                      The number of jobs executed
+ */
+template<typename J, typename P, typename F>
+std::size_t runJobs(AtomicArray<J, P> &atomicArray, F run){
+    std::size_t done = 0;
     while(1){
-        sleep(atomicArray.worker_start);
-        if(atomicArray.worker_end.load()) return;
-        while(1){
-            J* job = atomicArray.fetch();
-            if(!job){
-                wake_all(atomicArray.dispatcher_wake);
-                break;
+        try{
+            while(J* job = atomicArray.fetch()){
+                ++done;
+                run(*job);
             }
-            worker(*job);
+            return done;
+        } catch(...){
+            atomicArray.recordException(std::current_exception());
         }
     }
 }
-/*! @brief Allocates and initializes the worker threads
- * @tparam      J               The type of the jobs the user wants to execute 
+/*! @brief Executes jobs in ranges of contiguous jobs until the queue is empty. Exceptions thrown by the jobs are recorded in the array, see recordException().
+ * A range whose call throws counts as failed as a whole, since there's no telling which of its jobs were done.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @tparam      F               The type of the callable executing a range of jobs
  * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
- * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue  
- * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
- * @return                      A pointer to the allocated threads
+ * @param[in]   batchSize       The maximum number of jobs of each range
+ * @param[in]   run             The callable executing a range of jobs
+ * @return                      The number of jobs executed
  */
-template<typename J>
-std::thread* createThreads(AtomicArray<J> &atomicArray, void worker(J &job), int threadNumber=std::thread::hardware_concurrency()){
-    atomicArray.worker_start.store(0);
-    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
-    if(!threadNumber) threadNumber = 1;
-    std::thread *threads = new std::thread[threadNumber];
-    for(int i=0;i<threadNumber;++i){
-        threads[i] = std::thread(threadFunction<J>, std::ref(atomicArray), worker);
+template<typename J, typename P, typename F>
+std::size_t runRanges(AtomicArray<J, P> &atomicArray, std::size_t batchSize, F run){
+    std::size_t done = 0;
+    JobSpan<J> jobs = {nullptr, 0};
+    while(1){
+        try{
+            while(1){
+                jobs = atomicArray.fetchRange(batchSize);
+                if(!jobs.count) return done;
+                done += jobs.count;
+                run(jobs.jobs, jobs.count);
+            }
+        } catch(...){
+            atomicArray.recordException(std::current_exception(), (int) jobs.count);
+        }
     }
-    return threads;
 }
-
-/*! @brief Starts the worker threads and won't return until they're done. Resets the atomicArray to be reusable on exit.
- * @tparam      J               The type of the jobs the user wants to execute 
+/*! @brief Keeps the calling thread asleep on worker_park as long as its index is beyond the number of active threads
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
  * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   threadIndex     The index of the calling thread
+ * @return                      False if the thread has been told to return while parked
  */
-template<typename J> 
-void dispatchJobs(AtomicArray<J> &atomicArray){
-    wake_all(atomicArray.worker_start);
-    sleep(atomicArray.dispatcher_wake);
-    atomicArray.worker_start.store(0);
-    atomicArray.emptyOut();
+template<typename J, typename P>
+bool parkWhileInactive(AtomicArray<J, P> &atomicArray, int threadIndex){
+    std::uint32_t generation = atomicArray.worker_park.load();
+    while(threadIndex>=atomicArray.activeThreads.load()){
+        if(atomicArray.worker_end.load()) return false;
+        P::wait(atomicArray.worker_park, generation);
+        generation = atomicArray.worker_park.load();
+    }
+    return true;
 }
-
-/*! @brief Tells the worker threads to stop, waits on them to become joinable and then frees their allocated memory
- * @tparam      J               The type of the jobs the user wants to execute 
+/*! @brief Returns the futex word the given worker sleeps on, either its own or the shared worker_start
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
  * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
- * @param[in]   threads         The allocated threads to stop and free
- * @param[in]   threadNumber    The number of threads to end. Defaults to the number of cores on your machine, and just like createThreads won't exceed it even if you provide a number greater than it.
+ * @param[in]   threadIndex     The index of the worker
+ * @return                      The futex word of the worker
  */
-template<typename J> 
-void endThreads(AtomicArray<J> &atomicArray, std::thread *threads, int threadNumber=std::thread::hardware_concurrency()){
-    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
-    if(!threadNumber) threadNumber = 1;
-    atomicArray.worker_end.store(1);
-    wake_all(atomicArray.worker_start);
-    for(int i=0;i<threadNumber;++i){
-        threads[i].join();
-        wake_all(atomicArray.worker_start);
+template<typename J, typename P>
+std::atomic_uint32_t& wakeWord(AtomicArray<J, P> &atomicArray, int threadIndex){
+    return atomicArray.wake_slots ? atomicArray.wake_slots[threadIndex].word : atomicArray.worker_start;
+}
+/*! @brief Returns whether coroutines are waiting in schedule() for a worker to resume them
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @return                      True if at least one coroutine is waiting
+ */
+template<typename J, typename P>
+bool hasScheduled(AtomicArray<J, P> &atomicArray){
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+    return atomicArray.scheduled.load()!=nullptr;
+#else
+    (void) atomicArray;
+    return false;
+#endif
+}
+/*! @brief Resumes on the calling worker the coroutines waiting in schedule(), in the order they were scheduled
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void runScheduled(AtomicArray<J, P> &atomicArray){
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+    if(!atomicArray.scheduled.load(std::memory_order_relaxed)) return;
+    ScheduledCoroutine *list = atomicArray.scheduled.exchange(nullptr);
+    ScheduledCoroutine *ordered = nullptr;
+    while(list){
+        ScheduledCoroutine *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
     }
-    delete[] threads;
+    while(ordered){
+        ScheduledCoroutine *next = ordered->next;
+        ordered->handle.resume();
+        ordered = next;
+    }
+#else
+    (void) atomicArray;
+#endif
+}
+/*! @brief Puts the calling worker to sleep on its futex word until it's woken up for a new batch or the threads are told to return
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   threadIndex     The index of the calling worker
+ * @param[in]   generation      The value of the futex word the worker has already seen
+ * @return                      The new value of the futex word
+ */
+template<typename J, typename P>
+std::uint32_t sleepWorker(AtomicArray<J, P> &atomicArray, int threadIndex, std::uint32_t generation){
+    if(atomicArray.wake_slots){
+        WakeSlot &slot = atomicArray.wake_slots[threadIndex];
+        slot.sleeping.store(1);
+        while(slot.word.load()==generation && !atomicArray.worker_end.load() && !hasScheduled(atomicArray)){
+            P::wait(slot.word, generation);
+        }
+        slot.sleeping.store(0);
+        return slot.word.load();
+    }
+    if(atomicArray.worker_start.load()==generation){
+        atomicArray.sleeping_workers.fetch_add(1);
+        while(atomicArray.worker_start.load()==generation && !atomicArray.worker_end.load()){
+            P::wait(atomicArray.worker_start, generation);
+        }
+        atomicArray.sleeping_workers.fetch_sub(1);
+    }
+    return atomicArray.worker_start.load();
+}
+/*! @brief Wakes up a specific worker for the current batch, for example the one whose cache already holds the data of the batch. The worker joins the batch
+ * even if it wasn't asleep yet. Targeting a worker needs ThreadOptions::perThreadWake, otherwise any one of the sleeping workers is woken up.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   threadIndex     The index of the worker to wake up
+ */
+template<typename J, typename P>
+void wakeWorker(AtomicArray<J, P> &atomicArray, int threadIndex){
+    if(!atomicArray.wake_slots){
+        atomicArray.worker_start.fetch_add(1);
+        if(atomicArray.sleeping_workers.load()) P::wake(atomicArray.worker_start, 1);
+        return;
+    }
+    WakeSlot &slot = atomicArray.wake_slots[threadIndex];
+    slot.word.fetch_add(1);
+    if(slot.sleeping.exchange(0)) P::wake(slot.word, 1);
+}
+/*! @brief Wakes up the workers, skipping the syscall altogether for the ones that aren't asleep
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   count           The maximum number of workers to wake up, the others keep sleeping until woken up by a peer or by a later batch.
+ *                              With ThreadOptions::perThreadWake the ones with the lowest indices are woken up, otherwise any of them.
+ */
+template<typename J, typename P>
+void wakeWorkers(AtomicArray<J, P> &atomicArray, int count=INT_MAX){
+    if(atomicArray.wake_slots){
+        count = std::min(count, atomicArray.threadCount);
+        for(int i=0;i<count;++i) wakeWorker(atomicArray, i);
+        return;
+    }
+    atomicArray.worker_start.fetch_add(1);
+    if(atomicArray.sleeping_workers.load()) P::wake(atomicArray.worker_start, count);
+}
+/*! @brief Called by a worker joining a batch, wakes up one more sleeping worker if there are still more jobs waiting to be fetched than workers fetching them.
+ * Since each woken worker does the same, the wake ups spread along a chain for as long as the queue stays deep. Inactive workers call it too before parking,
+ * handing over the wake up they got.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void wakePeer(AtomicArray<J, P> &atomicArray){
+    if(atomicArray.wake_slots){
+        if(!(atomicArray.batch_id.load() & 1) || atomicArray.jobCount() - atomicArray.fetchedJobs() <= atomicArray.busy_workers.load()) return;
+        int active = std::min(atomicArray.activeThreads.load(), atomicArray.threadCount);
+        for(int i=0;i<active;++i){
+            if(atomicArray.wake_slots[i].sleeping.load()){
+                wakeWorker(atomicArray, i);
+                return;
+            }
+        }
+        return;
+    }
+    if(!atomicArray.sleeping_workers.load() || !(atomicArray.batch_id.load() & 1)) return;
+    if(atomicArray.jobCount() - atomicArray.fetchedJobs() > atomicArray.busy_workers.load()) P::wake(atomicArray.worker_start, 1);
+}
+/*! @brief The loop shared by all the working thread functions, takes care of all the syncronization, sleeping and waking up
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @tparam      F               The type of the callable executing the jobs of a batch
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   context         The context of the calling thread
+ * @param[in]   runBatch        The callable executing jobs until the queue is empty, returning how many it executed
+ */
+template<typename J, typename P, typename F>
+void workerLoop(AtomicArray<J, P> &atomicArray, WorkerContext &context, F runBatch){
+    std::uint32_t served = 0;
+    std::uint32_t generation = wakeWord(atomicArray, context.threadIndex).load();
+    while(1){
+        runScheduled(atomicArray);
+        if(context.threadIndex>=atomicArray.activeThreads.load()) wakePeer(atomicArray);
+        if(!parkWhileInactive(atomicArray, context.threadIndex)) return;
+        if(atomicArray.worker_end.load()) return;
+        if(context.threadIndex<atomicArray.activeThreads.load() && atomicArray.enterBatch(&served)){
+            wakePeer(atomicArray);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::size_t done = runBatch();
+            atomicArray.busyNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            context.arena.reset();
+            bool last = atomicArray.markFinished(done);
+            atomicArray.leaveBatch();
+            if(last) finishBatch(atomicArray);
+        }
+        generation = sleepWorker(atomicArray, context.threadIndex, generation);
+    }
+}
+
+/*! @brief Wrapper function for the working thread function that takes care of all the syncronization, sleeping and waking up
+ * @tparam      J               The type of the jobs the user wants to execute 
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue  
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename J, typename P>
+void threadFunction(AtomicArray<J, P> &atomicArray, void worker(J &job), int threadIndex=0, int threadCount=1){
+    WorkerContext context(threadIndex, threadCount);
+    workerLoop(atomicArray, context, [&atomicArray, worker](){
+        return runJobs(atomicArray, worker);
+    });
+}
+/*! @brief Wrapper function for the working thread function, for workers that take the context of their thread
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue along with the context of the thread
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename J, typename P>
+void threadFunction(AtomicArray<J, P> &atomicArray, void worker(J &job, WorkerContext &context), int threadIndex=0, int threadCount=1){
+    WorkerContext context(threadIndex, threadCount);
+    workerLoop(atomicArray, context, [&atomicArray, worker, &context](){
+        return runJobs(atomicArray, [worker, &context](J &job){
+            worker(job, context);
+        });
+    });
+}
+/*! @brief Wrapper function for the working thread function, for workers that process a range of contiguous jobs per call
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on ranges of up to batchSize jobs in the queue
+ * @param[in]   batchSize       The maximum number of jobs passed to each call of the worker, 0 is treated as 1
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename J, typename P>
+void threadFunction(AtomicArray<J, P> &atomicArray, void worker(J *jobs, std::size_t count), std::size_t batchSize, int threadIndex=0, int threadCount=1){
+    batchSize = std::max<std::size_t>(batchSize, 1);
+    WorkerContext context(threadIndex, threadCount);
+    workerLoop(atomicArray, context, [&atomicArray, worker, batchSize](){
+        return runRanges(atomicArray, batchSize, worker);
+    });
+}
+/*! @brief Wrapper function for the working thread function, for workers that process a range of contiguous jobs per call and take the context of their thread
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on ranges of up to batchSize jobs in the queue along with the context of the thread
+ * @param[in]   batchSize       The maximum number of jobs passed to each call of the worker, 0 is treated as 1
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename J, typename P>
+void threadFunction(AtomicArray<J, P> &atomicArray, void worker(J *jobs, std::size_t count, WorkerContext &context), std::size_t batchSize, int threadIndex=0, int threadCount=1){
+    batchSize = std::max<std::size_t>(batchSize, 1);
+    WorkerContext context(threadIndex, threadCount);
+    workerLoop(atomicArray, context, [&atomicArray, worker, batchSize, &context](){
+        return runRanges(atomicArray, batchSize, [worker, &context](J *jobs, std::size_t count){
+            worker(jobs, count, context);
+        });
+    });
+}
+/*! @brief Touches the given amount of stack of the calling thread, so that it won't page fault on it later
+ * @param[in]   bytes           The amount of stack to touch, capped to the stack left below the calling frame minus some headroom
+ */
+__attribute__((noinline)) inline void prefaultStack(std::size_t bytes){
+    const std::size_t headroom = 64*1024;
+    pthread_attr_t attributes;
+    if(!pthread_getattr_np(pthread_self(), &attributes)){
+        void *stackLow;
+        std::size_t stackSize;
+        if(!pthread_attr_getstack(&attributes, &stackLow, &stackSize)){
+            std::size_t left = (std::size_t) (reinterpret_cast<std::uintptr_t>(&attributes) - reinterpret_cast<std::uintptr_t>(stackLow));
+            bytes = std::min(bytes, left>headroom ? left - headroom : 0);
+        }
+        pthread_attr_destroy(&attributes);
+    }
+    if(!bytes) return;
+    volatile unsigned char *stack = static_cast<unsigned char*>(alloca(bytes));
+    for(std::size_t i=0;i<bytes;i+=4096){
+        stack[i] = 0;
+    }
+}
+/*! @brief Applies a scheduling policy and nice value to the calling thread. Real time policies need CAP_SYS_NICE, so this can fail:
+ * the threads spawned by createThreads count their failures in schedulingFailures, and the details can be checked with pthread_getschedparam on threadHandle().
+ * @param[in]   policy          The scheduling policy, -1 to leave it alone
+ * @param[in]   priority        The static priority for the policy
+ * @param[in]   niceValue       The nice value, 0 to leave it alone
+ * @return                      False if either the policy or the nice value couldn't be applied
+ */
+inline bool applyScheduling(int policy, int priority, int niceValue){
+    bool applied = true;
+    if(policy>=0){
+        sched_param parameters;
+        parameters.sched_priority = priority;
+        if(pthread_setschedparam(pthread_self(), policy, &parameters)) applied = false;
+    }
+    if(niceValue){
+        if(setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), niceValue)) applied = false;
+    }
+    return applied;
+}
+/*! @brief Wraps the function run by each thread so that it first applies the options that need to be applied from inside the thread
+ * @param[in]   body            The function run by each thread, taking the index of the thread and the number of threads
+ * @param[in]   options         The options for the threads
+ * @return                      The wrapped function
+ */
+inline std::function<void(int, int)> wrapThreadBody(std::function<void(int, int)> body, const ThreadOptions &options){
+    std::size_t stack = options.prefaultStack;
+    std::string name = options.name;
+    return [body, stack, name](int threadIndex, int threadCount){
+        if(!name.empty()) pthread_setname_np(pthread_self(), (name + "-" + std::to_string(threadIndex)).substr(0, 15).c_str());
+        if(stack) prefaultStack(stack);
+        body(threadIndex, threadCount);
+    };
+}
+/// @brief What a thread created with pthread_create runs, see threadStart()
+struct ThreadStart{
+    std::function<void(int, int)> body;         ///< The function run by the thread, taking the index of the thread and the number of threads
+    int threadIndex;                            ///< The index of the thread
+    int threadCount;                            ///< The number of threads
+};
+/*! @brief Entry point of the threads created with pthread_create, runs the body and frees its ThreadStart
+ * @param[in]   argument        The ThreadStart of the thread, allocated with new
+ * @return                      Always null
+ */
+inline void* threadStart(void *argument){
+    std::unique_ptr<ThreadStart> start(static_cast<ThreadStart*>(argument));
+    start->body(start->threadIndex, start->threadCount);
+    return nullptr;
+}
+/*! @brief Spawns a range of threads, applying the options that need to be applied from outside the threads.
+ * Threads with a custom stack size are created with pthread_create and their own attributes, the others with std::thread.
+ * If a scheduling policy or nice value is set, waits for the new threads to apply it so that schedulingFailures is final on return.
+ * @param[out]  threads             The array the std::thread threads are stored into
+ * @param[out]  nativeThreads       The array the handles of all the threads are stored into
+ * @param[in]   from                The index of the first thread to spawn
+ * @param[in]   to                  The index past the last thread to spawn
+ * @param[in]   threadCount         The total number of threads, passed to the body
+ * @param[in]   threadBody          The function run by each thread, taking the index of the thread and the number of threads
+ * @param[in]   options             The options for the threads
+ * @param[out]  schedulingFailures  Incremented by each thread that fails to apply its scheduling options
+ * @note        Throws std::runtime_error if a thread can't be created
+ */
+inline void startThreads(std::thread *threads, pthread_t *nativeThreads, int from, int to, int threadCount, const std::function<void(int, int)> &threadBody, const ThreadOptions &options, std::atomic_int &schedulingFailures){
+    std::function<void(int, int)> body = threadBody;
+    std::atomic_int scheduled(0);
+    bool scheduling = options.schedulingPolicy>=0 || options.niceValue;
+    if(scheduling){
+        std::atomic_int *failures = &schedulingFailures;
+        std::atomic_int *applied = &scheduled;
+        int policy = options.schedulingPolicy;
+        int priority = options.priority;
+        int niceValue = options.niceValue;
+        body = [threadBody, failures, applied, policy, priority, niceValue](int threadIndex, int threadCount){
+            if(!applyScheduling(policy, priority, niceValue)) failures->fetch_add(1);
+            applied->fetch_add(1);
+            threadBody(threadIndex, threadCount);
+        };
+    }
+    pthread_attr_t attributes;
+    if(options.stackSize){
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, std::max<std::size_t>(options.stackSize, PTHREAD_STACK_MIN));
+    }
+    for(int i=from;i<to;++i){
+        if(options.stackSize){
+            ThreadStart *start = new ThreadStart{body, i, threadCount};
+            if(pthread_create(nativeThreads + i, &attributes, threadStart, start)){
+                delete start;
+                pthread_attr_destroy(&attributes);
+                while(scheduling && scheduled.load()<i - from) std::this_thread::yield();
+                throw std::runtime_error("pthread_create failed");
+            }
+        } else{
+            try{
+                threads[i] = std::thread(body, i, threadCount);
+            } catch(...){
+                while(scheduling && scheduled.load()<i - from) std::this_thread::yield();
+                throw;
+            }
+            nativeThreads[i] = threads[i].native_handle();
+        }
+    }
+    if(options.stackSize) pthread_attr_destroy(&attributes);
+    while(scheduling && scheduled.load()<to - from) std::this_thread::yield();
+}
+/*! @brief Joins the threads spawned by startThreads() and frees their arrays
+ * @param[in]   threads         The std::thread threads
+ * @param[in]   nativeThreads   The handles of the threads, joined directly for the threads created with pthread_create
+ * @param[in]   count           The number of threads spawned
+ */
+inline void joinThreads(std::thread *threads, pthread_t *nativeThreads, int count){
+    for(int i=0;i<count;++i){
+        if(threads[i].joinable()) threads[i].join();
+        else pthread_join(nativeThreads[i], nullptr);
+    }
+    delete[] threads;
+    delete[] nativeThreads;
+}
+/*! @brief Spawns the threads that haven't been spawned yet, up to the given index
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   count           The number of threads that must be running, capped to the number of threads created
+ */
+template<typename J, typename P>
+void spawnThreadsUpTo(AtomicArray<J, P> &atomicArray, int count){
+    count = std::min(count, atomicArray.threadCount);
+    if(count<=atomicArray.spawnedThreads) return;
+    startThreads(atomicArray.threads, atomicArray.native_threads, atomicArray.spawnedThreads, count, atomicArray.threadCount, atomicArray.threadBody, atomicArray.threadOptions, atomicArray.schedulingFailures);
+    atomicArray.spawnedThreads = count;
+}
+/*! @brief Spawns the threads for createThreads, whatever the signature of the worker
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @tparam      F               The type of the callable run by each thread
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   body            The callable run by each thread, usually calling threadFunction, taking the index of the thread and the number of threads
+ * @param[in]   threadNumber    The number of threads to spawn, capped to the number of cores on your machine
+ * @param[in]   options         The options for the threads
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P, typename F>
+std::thread* spawnThreads(AtomicArray<J, P> &atomicArray, F body, int threadNumber, const ThreadOptions &options){
+    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
+    if(!threadNumber) threadNumber = 1;
+    atomicArray.threadCount = threadNumber;
+    atomicArray.activeThreads.store(threadNumber);
+    atomicArray.threadBody = wrapThreadBody(body, options);
+    atomicArray.threads = new std::thread[threadNumber];
+    atomicArray.native_threads = new pthread_t[threadNumber];
+    atomicArray.spawnedThreads = 0;
+    atomicArray.threadOptions = options;
+    if(options.perThreadWake){
+        void *memory;
+        if(posix_memalign(&memory, alignof(WakeSlot), threadNumber * sizeof(WakeSlot))) throw std::bad_alloc();
+        atomicArray.wake_slots = static_cast<WakeSlot*>(memory);
+        for(int i=0;i<threadNumber;++i) new (atomicArray.wake_slots + i) WakeSlot();
+    }
+    if(!options.lazy) spawnThreadsUpTo(atomicArray, threadNumber);
+    return atomicArray.threads;
+}
+/*! @brief Allocates and initializes the worker threads
+ * @tparam      J               The type of the jobs the user wants to execute 
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue  
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P>
+std::thread* createThreads(AtomicArray<J, P> &atomicArray, void worker(J &job), int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, worker](int threadIndex, int threadCount){
+        threadFunction(atomicArray, worker, threadIndex, threadCount);
+    }, threadNumber, options);
+}
+/*! @brief Allocates and initializes the worker threads, for workers that take the context of their thread
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on each job in the queue along with the context of the thread.
+ *                              Memory taken from the context's arena is reclaimed when the thread runs out of jobs in the current batch.
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P>
+std::thread* createThreads(AtomicArray<J, P> &atomicArray, void worker(J &job, WorkerContext &context), int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, worker](int threadIndex, int threadCount){
+        threadFunction(atomicArray, worker, threadIndex, threadCount);
+    }, threadNumber, options);
+}
+/*! @brief Allocates and initializes the worker threads, for workers that process a range of contiguous jobs per call.
+ * Each thread claims up to batchSize jobs with a single atomic operation, so for tiny jobs the overhead of the pool is spread over the whole range.
+ * If the worker throws, the rest of its range is skipped and the whole range is counted by failedJobs().
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on ranges of up to batchSize jobs in the queue
+ * @param[in]   batchSize       The maximum number of jobs passed to each call of the worker, 0 is treated as 1
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P>
+std::thread* createThreads(AtomicArray<J, P> &atomicArray, void worker(J *jobs, std::size_t count), std::size_t batchSize, int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, worker, batchSize](int threadIndex, int threadCount){
+        threadFunction(atomicArray, worker, batchSize, threadIndex, threadCount);
+    }, threadNumber, options);
+}
+/*! @brief Allocates and initializes the worker threads, for workers that process a range of contiguous jobs per call and take the context of their thread.
+ * As with the other batch workers, a throwing call skips the rest of its range, and the whole range is counted by failedJobs().
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that does the job, provided by the user, gets called on ranges of up to batchSize jobs in the queue along with the context of the thread
+ * @param[in]   batchSize       The maximum number of jobs passed to each call of the worker, 0 is treated as 1
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P>
+std::thread* createThreads(AtomicArray<J, P> &atomicArray, void worker(J *jobs, std::size_t count, WorkerContext &context), std::size_t batchSize, int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, worker, batchSize](int threadIndex, int threadCount){
+        threadFunction(atomicArray, worker, batchSize, threadIndex, threadCount);
+    }, threadNumber, options);
+}
+
+/*! @brief Wakes up as many worker threads as there are jobs in the array, up to the number of active threads, spawning the lazy ones the batch needs first.
+ * Once the batch is opened a worker may finish it, and resume a coroutine that starts the next one, so after that only the wake up touches the array.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void startBatch(AtomicArray<J, P> &atomicArray){
+    int wanted = (int) std::min<std::size_t>(atomicArray.activeThreads.load(), atomicArray.jobCount());
+    if(atomicArray.spawnedThreads<atomicArray.threadCount) spawnThreadsUpTo(atomicArray, wanted);
+    atomicArray.batchStart = std::chrono::steady_clock::now();
+    atomicArray.busyNanoseconds.store(0);
+    atomicArray.dispatcher_wake.store(0);
+    atomicArray.openBatch();
+    if(wanted) wakeWorkers(atomicArray, wanted);
+}
+/*! @brief Puts the dispatcher to sleep until the batch is done, that is until finishBatch() has been called
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void waitBatch(AtomicArray<J, P> &atomicArray){
+    if(!atomicArray.jobCount()) return;
+    sleepDispatcher<P>(atomicArray.dispatcher_wake);
+}
+/*! @brief Puts the dispatcher to sleep until the batch is done or the deadline has passed
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   deadline        The time after which the dispatcher stops waiting
+ * @return                      True if the batch is done
+ */
+template<typename J, typename P>
+bool waitBatchUntil(AtomicArray<J, P> &atomicArray, std::chrono::steady_clock::time_point deadline){
+    if(!atomicArray.jobCount()) return true;
+    return sleepDispatcherUntil<P>(atomicArray.dispatcher_wake, deadline);
+}
+/*! @brief Starts the worker threads and won't return until they're done. Resets the atomicArray to be reusable on exit.
+ * If any job threw an exception, the first one is rethrown once the batch is done.
+ * @tparam      J               The type of the jobs the user wants to execute 
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P> 
+void dispatchJobs(AtomicArray<J, P> &atomicArray){
+    startBatch(atomicArray);
+    waitBatch(atomicArray);
+    endBatch(atomicArray);
+    atomicArray.rethrowException();
+}
+/// @brief The outcome of dispatchJobsUntil and dispatchJobsFor
+struct DispatchStatus{
+    bool timedOut;                              ///< Whether the deadline passed before the batch was done
+    bool finished;                              ///< Whether the batch is over and the array reset to be reusable. If not, waitJobs() must be called before touching the array again.
+    std::size_t fetchedJobs;                    ///< The jobs taken by the workers, some of which may still be running if the batch isn't finished
+    std::size_t completedJobs;                  ///< The jobs executed. If the batch isn't finished yet, a lower bound, see AtomicArray::completedJobs()
+    std::size_t droppedJobs;                    ///< The jobs dropped without being executed, because the deadline passed or the batch was cancelled
+};
+/*! @brief Starts the worker threads and waits for them until the batch is done or the deadline has passed, whichever comes first.
+ * On timeout the jobs not fetched yet are dropped, as with cancelJobs(), unless dropUnfetched is false. If some jobs are still running
+ * the function returns anyway, and the array stays busy until waitJobs() is called.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   deadline        The time after which the dispatcher stops waiting
+ * @param[in]   dropUnfetched   Whether to drop the jobs not fetched yet when the deadline passes
+ * @return                      The outcome of the dispatch
+ */
+template<typename J, typename P>
+DispatchStatus dispatchJobsUntil(AtomicArray<J, P> &atomicArray, std::chrono::steady_clock::time_point deadline, bool dropUnfetched=true){
+    DispatchStatus status = {false, true, 0, 0, 0};
+    startBatch(atomicArray);
+    if(!waitBatchUntil(atomicArray, deadline)){
+        status.timedOut = true;
+        if(dropUnfetched){
+            bool finished;
+            atomicArray.cancel(finished);
+            if(finished) finishBatch(atomicArray);
+        }
+        status.finished = atomicArray.dispatcher_wake.load()==1;
+    }
+    status.completedJobs = atomicArray.completedJobs();
+    status.droppedJobs = atomicArray.droppedJobs();
+    status.fetchedJobs = atomicArray.fetchedJobs() - status.droppedJobs;
+    if(status.finished){
+        endBatch(atomicArray);
+        atomicArray.rethrowException();
+    }
+    return status;
+}
+/*! @brief Starts the worker threads and waits for them until the batch is done or the timeout has expired, see dispatchJobsUntil
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   timeout         How long the dispatcher waits at most
+ * @param[in]   dropUnfetched   Whether to drop the jobs not fetched yet when the timeout expires
+ * @return                      The outcome of the dispatch
+ */
+template<typename J, typename P, typename Rep, typename Period>
+DispatchStatus dispatchJobsFor(AtomicArray<J, P> &atomicArray, std::chrono::duration<Rep, Period> timeout, bool dropUnfetched=true){
+    return dispatchJobsUntil(atomicArray, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout), dropUnfetched);
+}
+/*! @brief Waits for a batch left running by dispatchJobsUntil or dispatchJobsFor to be done, and resets the atomicArray to be reusable.
+ * Does nothing if no batch is running.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void waitJobs(AtomicArray<J, P> &atomicArray){
+    if(!atomicArray.batchOpen()) return;
+    waitBatch(atomicArray);
+    endBatch(atomicArray);
+    atomicArray.rethrowException();
+}
+/*! @brief Returns an eventfd that becomes readable whenever a batch started by startJobs() is done, to be watched by an epoll or io_uring event loop
+ * that can't block in dispatchJobs, see startJobs(). The eventfd is created on the first call, non blocking, and closed along with the array.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @return                      The file descriptor of the eventfd
+ */
+template<typename J, typename P>
+int completionFd(AtomicArray<J, P> &atomicArray){
+    if(atomicArray.completion_fd<0){
+        atomicArray.completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(atomicArray.completion_fd<0) throw std::runtime_error("eventfd failed");
+    }
+    return atomicArray.completion_fd;
+}
+/*! @brief Starts the worker threads on the jobs in the array and returns right away. Once the batch is done the eventfd returned by completionFd()
+ * becomes readable, then finishJobs() must be called before touching the array again.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename J, typename P>
+void startJobs(AtomicArray<J, P> &atomicArray){
+    int fd = completionFd(atomicArray);
+    atomicArray.signal_completion = true;
+    startBatch(atomicArray);
+    if(!atomicArray.jobCount()) signalEventfd(fd);
+}
+/*! @brief Collects a batch started by startJobs() once the eventfd returned by completionFd() is readable: clears the eventfd, resets the atomicArray
+ * to be reusable, and rethrows the first exception thrown by a job, if any.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @note        If called before the eventfd is readable, it blocks until the batch is done
+ */
+template<typename J, typename P>
+void finishJobs(AtomicArray<J, P> &atomicArray){
+    std::uint64_t count;
+    while(read(atomicArray.completion_fd, &count, sizeof(count))<0 && errno==EINTR);
+    waitJobs(atomicArray);
+}
+/*! @brief Starts the worker threads and executes jobs on the calling thread too, until the queue is empty. Only then it goes to sleep,
+ * if some worker is still executing its last job. Resets the atomicArray to be reusable on exit.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @tparam      W               The type of the worker function
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The function executing the jobs on the calling thread, normally the one the threads were created with
+ */
+template<typename J, typename P, typename W>
+void dispatchAndRunJobs(AtomicArray<J, P> &atomicArray, W worker){
+    startBatch(atomicArray);
+    if(!atomicArray.dispatcher_context) atomicArray.dispatcher_context = new WorkerContext(atomicArray.threadCount, atomicArray.threadCount + 1);
+    WorkerContext &context = *atomicArray.dispatcher_context;
+    context.threadIndex = atomicArray.threadCount;
+    context.threadCount = atomicArray.threadCount + 1;
+    std::size_t done = runJobs(atomicArray, [worker, &context](J &job){
+        callWorker(worker, job, context);
+    });
+    atomicArray.busyNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - atomicArray.batchStart).count());
+    context.arena.reset();
+    if(!atomicArray.markFinished(done)) waitBatch(atomicArray);
+    endBatch(atomicArray);
+    atomicArray.rethrowException();
+}
+/*! @brief Starts the worker threads and takes part in executing the jobs, instead of sleeping while the workers run. Resets the atomicArray to be reusable on exit.
+ * Since the dispatcher works too, the threads can be created with one less than the number of cores.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The function executing the jobs on the calling thread, normally the one the threads were created with
+ */
+template<typename J, typename P>
+void dispatchJobs(AtomicArray<J, P> &atomicArray, void worker(J &job)){
+    dispatchAndRunJobs(atomicArray, worker);
+}
+/*! @brief Starts the worker threads and takes part in executing the jobs, for workers that take the context of their thread. Resets the atomicArray to be reusable on exit.
+ * The dispatcher gets a context of its own, kept in the array across batches, with threadIndex equal to the number of threads, so per thread arrays need one more element.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The function executing the jobs on the calling thread, normally the one the threads were created with
+ */
+template<typename J, typename P>
+void dispatchJobs(AtomicArray<J, P> &atomicArray, void worker(J &job, WorkerContext &context)){
+    dispatchAndRunJobs(atomicArray, worker);
+}
+/*! @brief Starts the worker threads on the jobs of an external buffer, without copying them into the array, and won't return until they're done.
+ * Resets the atomicArray to be reusable on exit.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the syncronization primitives for the job queue, must be empty
+ * @param[in]   jobs            The first job of the buffer
+ * @param[in]   count           The number of jobs in the buffer
+ */
+template<typename J, typename P>
+void dispatchJobs(AtomicArray<J, P> &atomicArray, J *jobs, std::size_t count){
+    atomicArray.borrow(jobs, count);
+    dispatchJobs(atomicArray);
+}
+
+/*! @brief Changes the number of threads taking part in the batches, without destroying any. The surplus threads, the ones with
+ * the highest indices, park on worker_park at the end of the current batch and cost nothing until they're activated again.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   count           The number of active threads, clamped between 1 and the number of threads created
+ */
+template<typename J, typename P>
+void setActiveThreads(AtomicArray<J, P> &atomicArray, int count){
+    count = std::max(1, std::min(count, atomicArray.threadCount));
+    atomicArray.activeThreads.store(count);
+    atomicArray.worker_park.fetch_add(1);
+    P::wake(atomicArray.worker_park, INT_MAX);
+}
+
+/*! @brief Adjusts the number of active threads by one, based on the last batch: threads are added if they were busy for more than 90% of
+ * the batch and there were more jobs than threads, removed if they were busy for less than half of it or there were fewer jobs than threads.
+ * Meant to be called by the dispatcher after dispatchJobs.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   minThreads      The number of active threads never to go below
+ * @return                      The new number of active threads
+ */
+template<typename J, typename P>
+int autoscaleThreads(AtomicArray<J, P> &atomicArray, int minThreads=1){
+    int active = std::min(atomicArray.activeThreads.load(), atomicArray.threadCount);
+    if(!atomicArray.batchNanoseconds || !atomicArray.batchJobs) return active;
+    double utilization = (double) atomicArray.busyNanoseconds.load() / ((double) atomicArray.batchNanoseconds * active);
+    int target = active;
+    if(utilization>0.9 && atomicArray.batchJobs>(std::size_t) active) target = active + 1;
+    else if(utilization<0.5 || atomicArray.batchJobs<(std::size_t) active) target = active - 1;
+    target = std::max(target, minThreads);
+    if(target!=active) setActiveThreads(atomicArray, target);
+    return std::min(std::max(1, target), atomicArray.threadCount);
+}
+
+/*! @brief Returns the handle of a worker thread, whichever way it was created, e.g. to inspect it with pthread_getschedparam
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array the threads were created for
+ * @param[in]   threadIndex     The index of the thread
+ * @return                      The pthread handle of the thread
+ * @note        Throws std::out_of_range if the thread hasn't been spawned, e.g. a lazy thread no batch needed yet
+ */
+template<typename J, typename P>
+pthread_t threadHandle(const AtomicArray<J, P> &atomicArray, int threadIndex){
+    if(threadIndex<0 || threadIndex>=atomicArray.spawnedThreads) throw std::out_of_range("threadHandle: thread not spawned");
+    return atomicArray.native_threads[threadIndex];
+}
+/*! @brief Tells the worker threads to stop, waits on them to become joinable and then frees their allocated memory
+ * @tparam      J               The type of the jobs the user wants to execute 
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   threads         The allocated threads to stop and free
+ * @param[in]   threadNumber    The number of threads to end. Defaults to the number of cores on your machine, and just like createThreads won't exceed it even if you provide a number greater than it.
+ */
+template<typename J, typename P> 
+void endThreads(AtomicArray<J, P> &atomicArray, std::thread *threads, int threadNumber=std::thread::hardware_concurrency()){
+    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
+    if(!threadNumber) threadNumber = 1;
+    atomicArray.worker_end.store(1);
+    wakeWorkers(atomicArray);
+    atomicArray.worker_park.fetch_add(1);
+    P::wake(atomicArray.worker_park, INT_MAX);
+    joinThreads(threads, atomicArray.native_threads, std::min(threadNumber, atomicArray.spawnedThreads));
+    std::free(atomicArray.wake_slots);
+    atomicArray.threads = nullptr;
+    atomicArray.native_threads = nullptr;
+    atomicArray.wake_slots = nullptr;
+    atomicArray.spawnedThreads = 0;
+}
+
+/*! @brief Type erased job queue attached to SharedWorkers
+ */
+class SharedQueueBase{
+    public:
+        virtual ~SharedQueueBase(){}
+        /*! @brief Executes the jobs of the pending batch of the queue, if any, until the queue is empty
+         *  @param[in]  context The context of the calling thread
+         *  @return             True if any job has been executed
+         */
+        virtual bool run(WorkerContext &context) = 0;
+};
+
+/*! @brief A job queue attached to SharedWorkers, executing the jobs of an AtomicArray with the worker it was attached with
+ * @tparam J The type of the jobs the user wants to execute
+ * @tparam P The wait policy of the array
+ * @tparam W The type of the worker function
+ */
+template<typename J, typename P, typename W>
+class SharedQueue : public SharedQueueBase{
+    public:
+        /*! @brief Constructor for SharedQueue
+         *  @param[in]  atomicArray The array providing the memory and syncronization primitives for the job queue
+         *  @param[in]  worker      The actual function that does the job, provided by the user
+         */
+        SharedQueue(AtomicArray<J, P> &atomicArray, W worker) : atomicArray(atomicArray), worker(worker){}
+        bool run(WorkerContext &context){
+            if(!atomicArray.enterBatch(nullptr)) return false;
+            W worker = this->worker;
+            std::size_t done = runJobs(atomicArray, [worker, &context](J &job){
+                callWorker(worker, job, context);
+            });
+            bool last = atomicArray.markFinished(done);
+            atomicArray.leaveBatch();
+            if(last) finishBatch(atomicArray);
+            return done>0;
+        }
+    private:
+        AtomicArray<J, P> &atomicArray;            ///< The array providing the memory and syncronization primitives for the job queue
+        W worker;                               ///< The actual function that does the job
+};
+
+/*! @brief A single set of worker threads serving the job queues of several AtomicArrays, each with its own dispatcher.
+ *
+ * Each subsystem keeps its AtomicArray and dispatcher thread, attaches the array once with attach(), and dispatches with
+ * dispatchJobs(sharedWorkers, atomicArray), which only waits for the jobs of that array. The workers scan the attached arrays
+ * with pending batches and sleep on a single word when none has jobs left. Attaching is lock free, and can happen while the threads run.
+ * @tparam P The wait policy the workers sleep and wake up with, see FutexWait. The attached arrays keep their own for their dispatchers.
+ */
+template<typename P>
+class BasicSharedWorkers{
+    public:
+        /*! @brief Constructor for BasicSharedWorkers
+         *  @param[in]  maxQueues   The maximum number of arrays that can be attached
+         */
+        explicit BasicSharedWorkers(int maxQueues=16){
+            this->maxQueues = maxQueues;
+            queues = new std::atomic<SharedQueueBase*>[maxQueues];
+            for(int i=0;i<maxQueues;++i) queues[i].store(nullptr);
+            reserved.store(0);
+            worker_wake = 0;
+            worker_end = 0;
+            native_threads = nullptr;
+            schedulingFailures.store(0);
+        }
+        BasicSharedWorkers(const BasicSharedWorkers&) = delete;
+        BasicSharedWorkers& operator=(const BasicSharedWorkers&) = delete;
+        ///@brief Destructor for BasicSharedWorkers, frees the queues, the threads must have been ended already
+        ~BasicSharedWorkers(){
+            for(int i=0;i<maxQueues;++i) delete queues[i].load();
+            delete[] queues;
+        }
+        /*! @brief Attaches an array to the workers
+         *  @tparam     J           The type of the jobs the user wants to execute
+         *  @tparam     Q           The wait policy of the array
+         *  @param[in]  atomicArray The array to attach, must outlive the SharedWorkers and not have threads of its own
+         *  @param[in]  worker      The actual function that does the job, provided by the user, gets called on each job in the array
+         */
+        template<typename J, typename Q>
+        void attach(AtomicArray<J, Q> &atomicArray, void worker(J &job)){
+            addQueue(new SharedQueue<J, Q, void (*)(J&)>(atomicArray, worker));
+        }
+        /*! @brief Attaches an array to the workers, for workers that take the context of their thread
+         *  @tparam     J           The type of the jobs the user wants to execute
+         *  @tparam     Q           The wait policy of the array
+         *  @param[in]  atomicArray The array to attach, must outlive the SharedWorkers and not have threads of its own
+         *  @param[in]  worker      The actual function that does the job, provided by the user, gets called on each job in the array along with the context of the thread
+         */
+        template<typename J, typename Q>
+        void attach(AtomicArray<J, Q> &atomicArray, void worker(J &job, WorkerContext &context)){
+            addQueue(new SharedQueue<J, Q, void (*)(J&, WorkerContext&)>(atomicArray, worker));
+        }
+        /*! @brief Executes the pending jobs of all the attached arrays until none is left
+         *  @param[in]  context The context of the calling thread
+         *  @return             True if any job has been executed
+         */
+        bool run(WorkerContext &context){
+            bool worked = false;
+            int count = std::min(reserved.load(), maxQueues);
+            for(int i=0;i<count;++i){
+                SharedQueueBase *queue = queues[i].load();
+                if(queue && queue->run(context)) worked = true;
+            }
+            return worked;
+        }
+        std::atomic_uint32_t worker_wake;       ///< The futex word the workers sleep on, bumped by every dispatch
+        std::atomic_uint32_t worker_end;        ///< The atomic used as a syncronization primitive to tell the workers whether to return and become joinable
+        pthread_t *native_threads;              ///< The handles of all the threads spawned by createThreads, whether they were created with std::thread or pthread_create, see threadHandle()
+        std::atomic_int schedulingFailures;     ///< The number of threads that couldn't apply ThreadOptions::schedulingPolicy or niceValue, final once createThreads returns
+    private:
+        void addQueue(SharedQueueBase *queue){
+            int index = reserved.fetch_add(1);
+            if(index>=maxQueues){
+                delete queue;
+                throw std::length_error("SharedWorkers: too many attached arrays");
+            }
+            queues[index].store(queue);
+        }
+        std::atomic<SharedQueueBase*> *queues;  ///< The attached queues, null until their attach() completes
+        std::atomic_int reserved;               ///< The number of slots of queues taken
+        int maxQueues;                          ///< The number of slots of queues
+};
+/// @brief BasicSharedWorkers sleeping on futexes, the default wait policy
+typedef BasicSharedWorkers<FutexWait> SharedWorkers;
+
+/*! @brief The working thread function of SharedWorkers
+ * @tparam      P               The wait policy of the workers
+ * @param[in]   sharedWorkers   The workers the thread belongs to
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename P>
+void threadFunction(BasicSharedWorkers<P> &sharedWorkers, int threadIndex=0, int threadCount=1){
+    WorkerContext context(threadIndex, threadCount);
+    while(1){
+        std::uint32_t generation = sharedWorkers.worker_wake.load();
+        if(sharedWorkers.worker_end.load()) return;
+        bool worked = sharedWorkers.run(context);
+        context.arena.reset();
+        if(!worked) P::wait(sharedWorkers.worker_wake, generation);
+    }
+}
+/*! @brief Allocates and initializes the threads of SharedWorkers
+ * @tparam      P               The wait policy of the workers
+ * @param[in]   sharedWorkers   The workers the threads belong to
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions. lazy is ignored.
+ * @return                      A pointer to the allocated threads
+ */
+template<typename P>
+std::thread* createThreads(BasicSharedWorkers<P> &sharedWorkers, int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
+    if(!threadNumber) threadNumber = 1;
+    std::thread *threads = new std::thread[threadNumber];
+    sharedWorkers.native_threads = new pthread_t[threadNumber];
+    BasicSharedWorkers<P> *workers = &sharedWorkers;
+    startThreads(threads, sharedWorkers.native_threads, 0, threadNumber, threadNumber, wrapThreadBody([workers](int threadIndex, int threadCount){
+        threadFunction(*workers, threadIndex, threadCount);
+    }, options), options, sharedWorkers.schedulingFailures);
+    return threads;
+}
+/*! @brief Dispatches the jobs of an attached array to the shared workers and won't return until they're done. Resets the atomicArray to be reusable on exit.
+ * Other dispatchers can dispatch their own arrays at the same time.
+ * @tparam      W               The wait policy of the workers
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   sharedWorkers   The workers the array is attached to
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ */
+template<typename W, typename J, typename P>
+void dispatchJobs(BasicSharedWorkers<W> &sharedWorkers, AtomicArray<J, P> &atomicArray){
+    if(atomicArray.jobCount()){
+        atomicArray.dispatcher_wake.store(0);
+        atomicArray.openBatch();
+        sharedWorkers.worker_wake.fetch_add(1);
+        W::wake(sharedWorkers.worker_wake, INT_MAX);
+        sleepDispatcher<P>(atomicArray.dispatcher_wake);
+        atomicArray.closeBatch();
+    }
+    atomicArray.emptyOut();
+    atomicArray.rethrowException();
+}
+/*! @brief Returns the handle of a thread of SharedWorkers, whichever way it was created, e.g. to inspect it with pthread_getschedparam
+ * @tparam      P               The wait policy of the workers
+ * @param[in]   sharedWorkers   The workers the threads belong to
+ * @param[in]   threadIndex     The index of the thread, below the number of threads spawned by createThreads
+ * @return                      The pthread handle of the thread
+ */
+template<typename P>
+pthread_t threadHandle(const BasicSharedWorkers<P> &sharedWorkers, int threadIndex){
+    return sharedWorkers.native_threads[threadIndex];
+}
+/*! @brief Tells the threads of SharedWorkers to stop, waits on them to become joinable and then frees their allocated memory
+ * @tparam      P               The wait policy of the workers
+ * @param[in]   sharedWorkers   The workers the threads belong to
+ * @param[in]   threads         The allocated threads to stop and free
+ * @param[in]   threadNumber    The number of threads to end, the same passed to createThreads
+ */
+template<typename P>
+void endThreads(BasicSharedWorkers<P> &sharedWorkers, std::thread *threads, int threadNumber=std::thread::hardware_concurrency()){
+    threadNumber = std::min(threadNumber, (int) std::thread::hardware_concurrency());
+    if(!threadNumber) threadNumber = 1;
+    sharedWorkers.worker_end.store(1);
+    sharedWorkers.worker_wake.fetch_add(1);
+    P::wake(sharedWorkers.worker_wake, INT_MAX);
+    joinThreads(threads, sharedWorkers.native_threads, threadNumber);
+    sharedWorkers.native_threads = nullptr;
+}
+
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_COROUTINES
+/// @brief The job type of an AtomicArray used to run coroutines on the worker threads
+typedef std::coroutine_handle<> CoroutineJob;
+
+/*! @brief Worker function to pass to createThreads for an AtomicArray<CoroutineJob>, resumes the enqueued coroutine
+ * @param[in]   job             The handle of the coroutine to resume
+ */
+inline void resumeCoroutine(CoroutineJob &job){
+    job.resume();
+}
+
+/*! @brief Awaitable returned by schedule(), hands the awaiting coroutine over to a worker of the array on suspension
+ * @tparam J The type of the jobs of the array
+ * @tparam P The wait policy of the array
+ */
+template<typename J, typename P>
+class ScheduleAwaiter{
+    public:
+        /*! @brief Constructor for ScheduleAwaiter
+         *  @param[in]  atomicArray The array whose workers will resume the awaiting coroutine
+         */
+        explicit ScheduleAwaiter(AtomicArray<J, P> &atomicArray) : atomicArray(atomicArray){}
+        bool await_ready() const noexcept{
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle){
+            node.handle = handle;
+            node.next = atomicArray.scheduled.load(std::memory_order_relaxed);
+            AtomicArray<J, P> &array = atomicArray;
+            while(!array.scheduled.compare_exchange_weak(node.next, &node));
+            // From here on the coroutine may already be running on a worker, and this awaiter destroyed along with its frame
+            wakeScheduler(array);
+        }
+        void await_resume() const noexcept{}
+    private:
+        /*! @brief Wakes up a worker to resume the scheduled coroutines. If none is asleep they're all about to check for them before sleeping, see sleepWorker().
+         *  @param[in]  array   The array whose workers resume the coroutines
+         */
+        static void wakeScheduler(AtomicArray<J, P> &array){
+            if(!array.wake_slots){
+                wakeWorker(array, 0);
+                return;
+            }
+            int active = std::min(array.activeThreads.load(), array.threadCount);
+            for(int i=0;i<active;++i){
+                if(array.wake_slots[i].sleeping.load()){
+                    wakeWorker(array, i);
+                    return;
+                }
+            }
+        }
+        AtomicArray<J, P> &atomicArray;            ///< The array whose workers resume the awaiting coroutine
+        ScheduledCoroutine node;                ///< The entry of the awaiting coroutine in the list of scheduled ones
+};
+
+/*! @brief Moves the awaiting coroutine onto the worker threads: `co_await schedule(atomicArray)` suspends it and wakes up a worker of the array,
+ * which resumes it before going back to sleep, or after its current batch if they're all busy. Can be awaited from any thread, workers included.
+ * @tparam      J               The type of the jobs of the array
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array, with threads of its own already spawned, whose workers resume the coroutine
+ * @note        The coroutine runs on the worker between batches, so it must not touch the array unless nothing else dispatches from it.
+ *              Coroutines still scheduled when the threads are ended are never resumed.
+ */
+template<typename J, typename P>
+ScheduleAwaiter<J, P> schedule(AtomicArray<J, P> &atomicArray){
+    return ScheduleAwaiter<J, P>(atomicArray);
+}
+
+/*! @brief Awaitable returned by dispatchJobsAsync(), starts the worker threads on suspension
+ * @tparam J The type of the jobs the user wants to execute
+ * @tparam P The wait policy of the array
+ */
+template<typename J, typename P>
+class DispatchAwaiter{
+    public:
+        /*! @brief Constructor for DispatchAwaiter
+         *  @param[in]  atomicArray The array whose jobs will be dispatched
+         */
+        explicit DispatchAwaiter(AtomicArray<J, P> &atomicArray) : atomicArray(atomicArray){}
+        bool await_ready() const noexcept{
+            return !atomicArray.jobCount();
+        }
+        void await_suspend(std::coroutine_handle<> handle){
+            atomicArray.continuation = handle;
+            startBatch(atomicArray);
+        }
+        void await_resume(){
+            atomicArray.rethrowException();
+        }
+    private:
+        AtomicArray<J, P> &atomicArray;            ///< The array whose jobs are dispatched
+};
+
+/*! @brief Asynchronous version of dispatchJobs: `co_await dispatchJobsAsync(atomicArray)` starts the worker threads and suspends the
+ * awaiting coroutine instead of putting the thread to sleep. The coroutine is resumed, already reset to be reusable, on the worker thread that executes the last job.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @note        Since the coroutine is resumed on a worker thread, it should dispatch again with dispatchJobsAsync rather than dispatchJobs
+ */
+template<typename J, typename P>
+DispatchAwaiter<J, P> dispatchJobsAsync(AtomicArray<J, P> &atomicArray){
+    return DispatchAwaiter<J, P>(atomicArray);
+}
+#endif
+
+#ifdef SIMPLE_ATOMIC_WORKER_POOL_IO_URING
+/// @brief A read of a file range, issued by an I/O job before its computation, see createThreads() for I/O jobs
+struct IoRead{
+    int fd;                                     ///< The file to read from
+    void *buffer;                               ///< Where to read the data into, must stay valid until the job is completed
+    std::uint32_t length;                       ///< The number of bytes to read
+    std::uint64_t offset;                       ///< The offset in the file to read from
+};
+
+/*! @brief Minimal io_uring submission and completion ring, owned by a single worker thread and driven through the raw syscalls.
+ * If the kernel refuses to set up the ring, or doesn't support IORING_OP_READ like before Linux 5.6, valid() is false and the reads are done with pread instead.
+ */
+class IoRing{
+    public:
+        /*! @brief Constructor for IoRing
+         *  @param[in]  entries The number of reads that can be in flight at the same time
+         */
+        explicit IoRing(unsigned entries){
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            pending = 0;
+            sqRing = cqRing = MAP_FAILED;
+            sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+            ringFd = (int) syscall(__NR_io_uring_setup, entries, &params);
+            if(ringFd<0) return;
+            if(!supportsRead()){
+                release();
+                return;
+            }
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if(singleMmap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+            sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            sqes = static_cast<io_uring_sqe*>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+            if(sqRing==MAP_FAILED || cqRing==MAP_FAILED || sqes==MAP_FAILED){
+                release();
+                return;
+            }
+            sqEntries = params.sq_entries;
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            char *sq = static_cast<char*>(sqRing);
+            char *cq = static_cast<char*>(cqRing);
+            sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        }
+        IoRing(const IoRing&) = delete;
+        IoRing& operator=(const IoRing&) = delete;
+        ///@brief Destructor for IoRing, unmaps the rings and closes the ring file descriptor
+        ~IoRing(){
+            release();
+        }
+        /// @brief Returns whether the ring has been set up, otherwise the reads have to be done synchronously
+        bool valid() const{
+            return ringFd>=0;
+        }
+        /*! @brief Queues a read, submitted to the kernel on the next call to submit()
+         *  @param[in]  read        The read to queue
+         *  @param[in]  userData    The value handed back along with the result of the read
+         *  @return                 False if the submission queue is full
+         */
+        bool push(const IoRead &read, std::uint64_t userData){
+            unsigned tail = *sqTail;
+            if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)>=sqEntries) return false;
+            unsigned index = tail & sqMask;
+            io_uring_sqe &sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = read.fd;
+            sqe.addr = (std::uint64_t) (std::uintptr_t) read.buffer;
+            sqe.len = read.length;
+            sqe.off = read.offset;
+            sqe.user_data = userData;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++pending;
+            return true;
+        }
+        /*! @brief Submits the queued reads, and waits for some of the reads in flight to complete
+         *  @param[in]  waitFor The number of completions to wait for, 0 to return right away
+         *  @return             0, or a negated errno if the kernel refused the queued reads, which are then left in the queue, see takeBack()
+         */
+        int submit(unsigned waitFor){
+            while(1){
+                int submitted = (int) syscall(__NR_io_uring_enter, ringFd, pending, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if(submitted>=0){
+                    pending -= (unsigned) submitted;
+                    return 0;
+                }
+                if(errno==EINTR || errno==EAGAIN || errno==EBUSY) continue;
+                if(pending) return -errno;
+                while(waitFor && *cqHead==__atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) sched_yield();
+                return 0;
+            }
+        }
+        /*! @brief Takes back the queued reads the kernel hasn't consumed yet, after submit() failed
+         *  @tparam     F           The type of the callable
+         *  @param[in]  onRead      The callable, taking the user data of the read and the read itself
+         */
+        template<typename F>
+        void takeBack(F onRead){
+            unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            unsigned tail = *sqTail;
+            __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+            pending = 0;
+            for(;head!=tail;++head){
+                io_uring_sqe &sqe = sqes[sqArray[head & sqMask]];
+                IoRead read = {sqe.fd, (void*) (std::uintptr_t) sqe.addr, sqe.len, sqe.off};
+                onRead(sqe.user_data, read);
+            }
+        }
+        /*! @brief Hands the completed reads over to the callable
+         *  @tparam     F           The type of the callable
+         *  @param[in]  onComplete  The callable, taking the user data of the read and its result, the number of bytes read or a negated errno
+         */
+        template<typename F>
+        void reap(F onComplete){
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while(head!=tail){
+                io_uring_cqe &cqe = cqes[head & cqMask];
+                std::uint64_t userData = cqe.user_data;
+                int result = cqe.res;
+                ++head;
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                onComplete(userData, result);
+            }
+        }
+    private:
+        /*! @brief Asks the kernel whether it supports IORING_OP_READ, which Linux 5.1 to 5.5 set up rings for but fail with -EINVAL
+         *  @return True if reads can go through the ring
+         */
+        bool supportsRead(){
+            const unsigned opCount = 256;
+            io_uring_probe *probe = static_cast<io_uring_probe*>(std::calloc(1, sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op)));
+            if(!probe) return false;
+            bool supported = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, opCount)>=0
+                && probe->last_op>=IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+            std::free(probe);
+            return supported;
+        }
+        /// @brief Unmaps the rings and closes the ring file descriptor
+        void release(){
+            if(sqes!=MAP_FAILED) munmap(sqes, sqesSize);
+            if(cqRing!=MAP_FAILED && cqRing!=sqRing) munmap(cqRing, cqRingSize);
+            if(sqRing!=MAP_FAILED) munmap(sqRing, sqRingSize);
+            if(ringFd>=0) close(ringFd);
+            sqRing = cqRing = MAP_FAILED;
+            sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+            ringFd = -1;
+        }
+        int ringFd;                             ///< The file descriptor of the ring, -1 if it couldn't be set up
+        unsigned pending;                       ///< The number of queued reads not submitted yet
+        unsigned sqEntries;                     ///< The size of the submission queue
+        void *sqRing;                           ///< The mapped submission queue ring
+        void *cqRing;                           ///< The mapped completion queue ring, the same as sqRing with IORING_FEAT_SINGLE_MMAP
+        io_uring_sqe *sqes;                     ///< The mapped submission queue entries
+        std::size_t sqRingSize;                 ///< The size of the submission queue mapping
+        std::size_t cqRingSize;                 ///< The size of the completion queue mapping
+        std::size_t sqesSize;                   ///< The size of the submission queue entries mapping
+        unsigned *sqHead;                       ///< The head of the submission queue, moved by the kernel
+        unsigned *sqTail;                       ///< The tail of the submission queue, moved by the worker
+        unsigned sqMask;                        ///< The mask turning submission queue positions into indices
+        unsigned *sqArray;                      ///< The indices of the submitted entries
+        unsigned *cqHead;                       ///< The head of the completion queue, moved by the worker
+        unsigned *cqTail;                       ///< The tail of the completion queue, moved by the kernel
+        unsigned cqMask;                        ///< The mask turning completion queue positions into indices
+        io_uring_cqe *cqes;                     ///< The completion queue entries
+};
+
+/*! @brief Executes I/O jobs until the queue is empty: each job issues a read through the ring of the calling thread, and is completed
+ * once the read is done. Up to queueDepth reads are kept in flight, and the jobs whose reads are done get completed while the others are pending.
+ * If the kernel refuses to submit the reads, they and the rest of the batch are read with pread instead.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   ring            The ring of the calling thread
+ * @param[in]   queueDepth      The maximum number of reads in flight
+ * @param[in]   prepare         Returns the read a job needs
+ * @param[in]   complete        Does the computation of a job, once its read is done
+ * @return                      The number of jobs executed
+ */
+template<typename J, typename P>
+std::size_t runIoJobs(AtomicArray<J, P> &atomicArray, IoRing &ring, unsigned queueDepth, IoRead prepare(J &job), void complete(J &job, int result)){
+    std::size_t done = 0;
+    unsigned inFlight = 0;
+    bool empty = false;
+    bool useRing = ring.valid();
+    while(1){
+        while(inFlight<queueDepth && !empty){
+            J *job = atomicArray.fetch();
+            if(!job){
+                empty = true;
+                break;
+            }
+            ++done;
+            try{
+                IoRead read = prepare(*job);
+                if(useRing && ring.push(read, (std::uint64_t) (std::uintptr_t) job)){
+                    ++inFlight;
+                    continue;
+                }
+                ssize_t result = pread(read.fd, read.buffer, read.length, (off_t) read.offset);
+                complete(*job, result<0 ? -errno : (int) result);
+            } catch(...){
+                atomicArray.recordException(std::current_exception());
+            }
+        }
+        if(!inFlight) return done;
+        if(ring.submit(1)){
+            useRing = false;
+            ring.takeBack([&atomicArray, &inFlight, complete](std::uint64_t userData, const IoRead &read){
+                --inFlight;
+                try{
+                    ssize_t result = pread(read.fd, read.buffer, read.length, (off_t) read.offset);
+                    complete(*reinterpret_cast<J*>((std::uintptr_t) userData), result<0 ? -errno : (int) result);
+                } catch(...){
+                    atomicArray.recordException(std::current_exception());
+                }
+            });
+            continue;
+        }
+        ring.reap([&atomicArray, &inFlight, complete](std::uint64_t userData, int result){
+            --inFlight;
+            try{
+                complete(*reinterpret_cast<J*>((std::uintptr_t) userData), result);
+            } catch(...){
+                atomicArray.recordException(std::current_exception());
+            }
+        });
+    }
+}
+/*! @brief Wrapper function for the working thread function, for I/O jobs, see runIoJobs()
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   prepare         Returns the read a job needs, provided by the user
+ * @param[in]   complete        Does the computation of a job once its read is done, provided by the user, gets the number of bytes read or a negated errno
+ * @param[in]   queueDepth      The maximum number of reads each thread keeps in flight, 0 is treated as 1
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename J, typename P>
+void threadFunction(AtomicArray<J, P> &atomicArray, IoRead prepare(J &job), void complete(J &job, int result), unsigned queueDepth, int threadIndex=0, int threadCount=1){
+    queueDepth = std::max(queueDepth, 1u);
+    WorkerContext context(threadIndex, threadCount);
+    IoRing ring(queueDepth);
+    workerLoop(atomicArray, context, [&atomicArray, &ring, queueDepth, prepare, complete](){
+        return runIoJobs(atomicArray, ring, queueDepth, prepare, complete);
+    });
+}
+/*! @brief Allocates and initializes the worker threads, for I/O jobs: each job first reads a file range, then computes on it. Each thread keeps up to
+ * queueDepth reads in flight through its own io_uring ring, completing the jobs whose data has arrived while the others are pending, so that a few
+ * threads can keep a fast drive busy. Needs Linux 5.6, with older kernels or where io_uring is disabled the reads are done with pread.
+ * @tparam      J               The type of the jobs the user wants to execute
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   prepare         Returns the read a job needs, provided by the user
+ * @param[in]   complete        Does the computation of a job once its read is done, provided by the user, gets the number of bytes read or a negated errno
+ * @param[in]   queueDepth      The maximum number of reads each thread keeps in flight, 0 is treated as 1
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename J, typename P>
+std::thread* createThreads(AtomicArray<J, P> &atomicArray, IoRead prepare(J &job), void complete(J &job, int result), unsigned queueDepth, int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, prepare, complete, queueDepth](int threadIndex, int threadCount){
+        threadFunction(atomicArray, prepare, complete, queueDepth, threadIndex, threadCount);
+    }, threadNumber, options);
+}
+#endif
+
+/*! @brief A file mapped read only into memory, to be processed in parallel with appendFileChunks() and the FileChunk overload of createThreads().
+ * The mapping is advised as sequential, so that the kernel reads ahead aggressively and drops the pages behind.
+ */
+class MappedFile{
+    public:
+        /*! @brief Constructor for MappedFile, maps the whole file
+         *  @param[in]  path    The path of the file
+         *  @note       Throws std::runtime_error if the file can't be opened or mapped
+         */
+        explicit MappedFile(const char *path){
+            fileData = nullptr;
+            fileSize = 0;
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if(fd<0) throw std::runtime_error(std::string("cannot open ") + path);
+            struct stat info;
+            if(fstat(fd, &info)<0){
+                close(fd);
+                throw std::runtime_error(std::string("cannot stat ") + path);
+            }
+            fileSize = (std::size_t) info.st_size;
+            if(fileSize){
+                void *memory = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(memory==MAP_FAILED){
+                    close(fd);
+                    throw std::runtime_error(std::string("cannot map ") + path);
+                }
+                fileData = static_cast<const char*>(memory);
+                madvise(memory, fileSize, MADV_SEQUENTIAL);
+            }
+            close(fd);
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ///@brief Destructor for MappedFile, unmaps the file
+        ~MappedFile(){
+            if(fileData) munmap(const_cast<char*>(fileData), fileSize);
+        }
+        /// @brief Returns the first byte of the file
+        const char* data() const{
+            return fileData;
+        }
+        /// @brief Returns the size of the file in bytes
+        std::size_t size() const{
+            return fileSize;
+        }
+    private:
+        const char *fileData;                   ///< The mapping of the file, null for an empty file
+        std::size_t fileSize;                   ///< The size of the file
+};
+
+/// @brief Job handed to the workers of a MappedFile, a range of its bytes
+struct FileChunk{
+    const char *data;                           ///< The first byte of the chunk
+    std::size_t size;                           ///< The number of bytes of the chunk
+    std::size_t offset;                         ///< The offset of the chunk in the file
+    const char *ahead;                          ///< The first byte of the chunk to prefetch when this one is fetched, null if none
+    std::size_t aheadSize;                      ///< The number of bytes to prefetch
+};
+
+/*! @brief Asks the kernel to start reading in a range of a mapping, without waiting for it
+ * @param[in]   data            The first byte of the range
+ * @param[in]   size            The number of bytes of the range
+ */
+inline void prefetchMapping(const char *data, std::size_t size){
+    std::uintptr_t pageSize = (std::uintptr_t) sysconf(_SC_PAGESIZE);
+    std::uintptr_t begin = (std::uintptr_t) data & ~(pageSize - 1);
+    madvise(reinterpret_cast<void*>(begin), (std::uintptr_t) data + size - begin, MADV_WILLNEED);
+}
+/*! @brief Splits a mapped file into chunks and enqueues them, to be dispatched as usual with dispatchJobs to threads created with the FileChunk overload of createThreads().
+ * The first chunks are prefetched right away, and each chunk carries the one prefetchChunks ahead of it, prefetched by the worker that fetches it,
+ * so that the reads stay ahead of the workers.
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array to enqueue the chunks into
+ * @param[in]   file            The file to split, must stay mapped until the chunks have been dispatched
+ * @param[in]   chunkSize       The size of the chunks, rounded up to a multiple of the page size
+ * @param[in]   delimiter       If not negative, each chunk is extended up to and including the next occurrence of this byte, so that no record is split
+ * @param[in]   prefetchChunks  How many chunks ahead of the workers are prefetched, 0 to rely on the sequential read ahead alone
+ * @return                      A span over the chunks in the array
+ */
+template<typename P>
+JobSpan<FileChunk> appendFileChunks(AtomicArray<FileChunk, P> &atomicArray, const MappedFile &file, std::size_t chunkSize, int delimiter=-1, std::size_t prefetchChunks=4){
+    std::size_t pageSize = (std::size_t) sysconf(_SC_PAGESIZE);
+    chunkSize = std::max<std::size_t>((chunkSize + pageSize - 1) / pageSize, 1) * pageSize;
+    const char *data = file.data();
+    std::size_t size = file.size();
+    std::size_t begin = 0;
+    std::size_t count = 0;
+    JobSpan<FileChunk> chunks = atomicArray.appendN((size + chunkSize - 1) / chunkSize, [data, size, chunkSize, delimiter, &begin, &count](std::size_t){
+        std::size_t end = std::min(begin + chunkSize, size);
+        if(delimiter>=0 && end<size){
+            const void *found = std::memchr(data + end - 1, delimiter, size - end + 1);
+            end = found ? (std::size_t) (static_cast<const char*>(found) - data) + 1 : size;
+        }
+        FileChunk chunk = {data + begin, end - begin, begin, nullptr, 0};
+        if(begin<size) ++count;
+        begin = end;
+        return chunk;
+    });
+    atomicArray.truncate(atomicArray.jobCount() - chunks.count + count);
+    chunks.count = count;
+    if(prefetchChunks){
+        for(std::size_t i=0;i<count;++i){
+            if(i<prefetchChunks) prefetchMapping(chunks[i].data, chunks[i].size);
+            if(i + prefetchChunks<count){
+                chunks[i].ahead = chunks[i + prefetchChunks].data;
+                chunks[i].aheadSize = chunks[i + prefetchChunks].size;
+            }
+        }
+    }
+    return chunks;
+}
+/*! @brief Wrapper function for the working thread function, for the chunks of a MappedFile, see appendFileChunks(). Before each chunk is handed to the worker,
+ * the chunk ahead of it is prefetched.
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that processes a chunk, provided by the user
+ * @param[in]   threadIndex     The index of the calling thread in the pool
+ * @param[in]   threadCount     The number of threads of the pool
+ */
+template<typename P>
+void threadFunction(AtomicArray<FileChunk, P> &atomicArray, void worker(FileChunk &chunk), int threadIndex=0, int threadCount=1){
+    WorkerContext context(threadIndex, threadCount);
+    workerLoop(atomicArray, context, [&atomicArray, worker](){
+        return runJobs(atomicArray, [worker](FileChunk &chunk){
+            if(chunk.ahead) prefetchMapping(chunk.ahead, chunk.aheadSize);
+            worker(chunk);
+        });
+    });
+}
+/*! @brief Allocates and initializes the worker threads for the chunks of a MappedFile, see appendFileChunks()
+ * @tparam      P               The wait policy of the array
+ * @param[in]   atomicArray     The array providing the memory and syncronization primitives for the job queue
+ * @param[in]   worker          The actual function that processes a chunk, provided by the user
+ * @param[in]   threadNumber    The number of threads to spawn. Defaults to the number of cores on your machine, and won't exceed it even if you provide a number greater than it.
+ * @param[in]   options         The options for the threads, see ThreadOptions
+ * @return                      A pointer to the allocated threads
+ */
+template<typename P>
+std::thread* createThreads(AtomicArray<FileChunk, P> &atomicArray, void worker(FileChunk &chunk), int threadNumber=std::thread::hardware_concurrency(), const ThreadOptions &options=ThreadOptions()){
+    return spawnThreads(atomicArray, [&atomicArray, worker](int threadIndex, int threadCount){
+        threadFunction(atomicArray, worker, threadIndex, threadCount);
+    }, threadNumber, options);
 }
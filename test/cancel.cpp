@@ -0,0 +1,67 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "simpleAtomicWorkerPool.hpp"
+
+#define CHECK(condition) do{ if(!(condition)){ std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); std::exit(1); } }while(0)
+
+static AtomicArray<int> *atomicArray;
+static std::atomic_int executed;
+static std::atomic_int sawCancelled;
+static int cancelAt;
+
+static void worker(int &job){
+    if(atomicArray->isCancelled()) sawCancelled.fetch_add(1);
+    if(job==cancelAt) cancelJobs(*atomicArray);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    executed.fetch_add(1);
+}
+
+static void fill(int count){
+    for(int i=0;i<count;++i) atomicArray->append(i);
+    executed.store(0);
+    sawCancelled.store(0);
+}
+
+// Cancels before, during and after a batch, to check that only the batch running when cancelJobs is called is affected
+int main(){
+    const int jobs = 1000;
+    AtomicArray<int> array(jobs);
+    atomicArray = &array;
+    std::thread *threads = createThreads(array, worker, 4);
+    cancelAt = -1;
+
+    fill(jobs);
+    cancelJobs(array);
+    CHECK(!array.isCancelled());
+    dispatchJobs(array);
+    CHECK(executed.load()==jobs);
+    CHECK(!sawCancelled.load());
+
+    fill(jobs);
+    cancelAt = 10;
+    dispatchJobs(array);
+    CHECK(executed.load()<jobs);
+    cancelAt = -1;
+
+    fill(jobs);
+    std::thread canceller([](){
+        while(!executed.load()) std::this_thread::yield();
+        cancelJobs(*atomicArray);
+    });
+    dispatchJobs(array);
+    canceller.join();
+    CHECK(executed.load()<jobs);
+
+    cancelJobs(array);
+    fill(jobs);
+    dispatchJobs(array);
+    CHECK(executed.load()==jobs);
+    CHECK(!sawCancelled.load());
+
+    endThreads(array, threads, 4);
+    std::puts("cancel ok");
+    return 0;
+}
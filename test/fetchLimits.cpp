@@ -0,0 +1,62 @@
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+#include "simpleAtomicWorkerPool.hpp"
+
+#define CHECK(condition) do{ if(!(condition)){ std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); std::exit(1); } }while(0)
+
+// Dispatches fetch() and fetchRange() over a borrowed buffer of more than 2^32 jobs, mapped but never touched,
+// to check that the cursors don't wrap around 32 bits and that polling an empty queue barely moves the head
+int main(){
+    if(sizeof(std::size_t)<8) return 77;
+    const std::size_t low = (std::size_t) 1 << 32;
+    const std::size_t count = low + 5;
+    void *memory = mmap(nullptr, count, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(memory==MAP_FAILED) return 77;
+    unsigned char *jobs = static_cast<unsigned char*>(memory);
+    AtomicArray<unsigned char> atomicArray(16);
+
+    atomicArray.borrow(jobs, count);
+    JobSpan<unsigned char> range = atomicArray.fetchRange(low - 2);
+    CHECK(range.jobs==jobs && range.count==low - 2);
+    CHECK(atomicArray.fetch()==jobs + low - 2);
+    CHECK(atomicArray.fetch()==jobs + low - 1);
+    CHECK(atomicArray.fetch()==jobs + low);
+    range = atomicArray.fetchRange(10);
+    CHECK(range.jobs==jobs + low + 1 && range.count==4);
+    CHECK(atomicArray.headPosition()==count + 6);
+    for(int i=0;i<1000;++i){
+        CHECK(!atomicArray.fetch());
+        CHECK(!atomicArray.fetchRange(10).count);
+    }
+    CHECK(atomicArray.headPosition()==count + 6);
+    CHECK(atomicArray.fetchedJobs()==count);
+    atomicArray.emptyOut();
+
+    const int threadNumber = 8;
+    atomicArray.borrow(jobs, count);
+    atomicArray.fetchRange(count - 1);
+    std::atomic_int fetched(0);
+    std::vector<std::thread> threads;
+    for(int i=0;i<threadNumber;++i){
+        threads.push_back(std::thread([&atomicArray, &fetched, jobs, count](){
+            for(int j=0;j<100000;++j){
+                unsigned char *job = atomicArray.fetch();
+                if(job){
+                    CHECK(job==jobs + count - 1);
+                    fetched.fetch_add(1);
+                }
+            }
+        }));
+    }
+    for(std::size_t i=0;i<threads.size();++i) threads[i].join();
+    CHECK(fetched.load()==1);
+    CHECK(atomicArray.headPosition()>=count && atomicArray.headPosition()<=count + threadNumber - 1);
+    atomicArray.emptyOut();
+
+    munmap(memory, count);
+    std::puts("fetch limits ok");
+    return 0;
+}